@@ -6,9 +6,12 @@
 
 #include "bluetooth-a2dp.h"
 
+#include <ctype.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <strings.h>
+#include <sys/types.h>
 
 #include "defs.h"
 
@@ -40,13 +43,106 @@ static const struct {
 	{ A2DP_CODEC_VENDOR_ID(SAMSUNG_SC_VENDOR_ID, SAMSUNG_SC_CODEC_ID), { "samsung-SC" } },
 };
 
+/**
+ * Number of slots in the alias and codec ID hash indexes. It has to be
+ * a power of two and larger than the number of keys, so that the probe
+ * sequences are always terminated by an empty slot. */
+#define A2DP_CODEC_INDEX_SLOTS 128
+
+_Static_assert(ARRAYSIZE(codecs) * ARRAYSIZE(codecs[0].aliases) < A2DP_CODEC_INDEX_SLOTS,
+		"A2DP codec index is too small");
+
+/* Index slots store the position in the codecs table plus one, so that
+ * zero can mark an empty slot. */
+static uint8_t codec_alias_index[A2DP_CODEC_INDEX_SLOTS];
+static uint8_t codec_id_index[A2DP_CODEC_INDEX_SLOTS];
+static const char * codec_alias_index_names[A2DP_CODEC_INDEX_SLOTS];
+static pthread_once_t codec_index_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Case-insensitive FNV-1a hash of the codec alias. */
+static uint32_t a2dp_codec_alias_hash(const char * alias) {
+	uint32_t hash = 2166136261u;
+	for (; *alias != '\0'; alias++)
+		hash = (hash ^ (uint8_t)tolower((unsigned char)*alias)) * 16777619u;
+	return hash;
+}
+
+static uint32_t a2dp_codec_id_hash(uint32_t codec) {
+	return (codec * 2654435761u) >> 16;
+}
+
+static void a2dp_codec_index_init(void) {
+	for (size_t i = 0; i < ARRAYSIZE(codecs); i++) {
+
+		/* Keep the first entry for the codec ID, the same
+		 * one which the linear table scan would find. */
+		size_t slot = a2dp_codec_id_hash(codecs[i].codec);
+		for (;; slot++) {
+			slot &= A2DP_CODEC_INDEX_SLOTS - 1;
+			if (codec_id_index[slot] == 0) {
+				codec_id_index[slot] = i + 1;
+				break;
+			}
+			if (codecs[codec_id_index[slot] - 1].codec == codecs[i].codec)
+				break;
+		}
+
+		for (size_t n = 0; n < ARRAYSIZE(codecs[i].aliases); n++) {
+			const char * alias;
+			if ((alias = codecs[i].aliases[n]) == NULL)
+				continue;
+			slot = a2dp_codec_alias_hash(alias);
+			for (;; slot++) {
+				slot &= A2DP_CODEC_INDEX_SLOTS - 1;
+				if (codec_alias_index[slot] == 0) {
+					codec_alias_index[slot] = i + 1;
+					codec_alias_index_names[slot] = alias;
+					break;
+				}
+				if (strcasecmp(codec_alias_index_names[slot], alias) == 0)
+					break;
+			}
+		}
+
+	}
+}
+
+/**
+ * Look up the codecs table entry by the codec name alias.
+ *
+ * @return Position in the codecs table or -1 if there was no match. */
+static ssize_t a2dp_codec_lookup_alias(const char * alias) {
+	pthread_once(&codec_index_once, a2dp_codec_index_init);
+	for (size_t slot = a2dp_codec_alias_hash(alias);; slot++) {
+		slot &= A2DP_CODEC_INDEX_SLOTS - 1;
+		if (codec_alias_index[slot] == 0)
+			return -1;
+		if (strcasecmp(codec_alias_index_names[slot], alias) == 0)
+			return codec_alias_index[slot] - 1;
+	}
+}
+
+/**
+ * Look up the codecs table entry by the codec ID.
+ *
+ * @return Position in the codecs table or -1 if there was no match. */
+static ssize_t a2dp_codec_lookup_id(uint32_t codec) {
+	pthread_once(&codec_index_once, a2dp_codec_index_init);
+	for (size_t slot = a2dp_codec_id_hash(codec);; slot++) {
+		slot &= A2DP_CODEC_INDEX_SLOTS - 1;
+		if (codec_id_index[slot] == 0)
+			return -1;
+		if (codecs[codec_id_index[slot] - 1].codec == codec)
+			return codec_id_index[slot] - 1;
+	}
+}
+
 uint32_t a2dp_codec_from_string(const char * alias) {
-	for (size_t i = 0; i < ARRAYSIZE(codecs); i++)
-		for (size_t n = 0; n < ARRAYSIZE(codecs[i].aliases); n++)
-			if (codecs[i].aliases[n] != NULL &&
-					strcasecmp(codecs[i].aliases[n], alias) == 0)
-				return codecs[i].codec;
-	return A2DP_CODEC_UNDEFINED;
+	ssize_t i;
+	if ((i = a2dp_codec_lookup_alias(alias)) == -1)
+		return A2DP_CODEC_UNDEFINED;
+	return codecs[i].codec;
 }
 
 uint32_t a2dp_codec_from_vendor_info(const a2dp_vendor_info_t * info) {
@@ -56,17 +152,15 @@ uint32_t a2dp_codec_from_vendor_info(const a2dp_vendor_info_t * info) {
 }
 
 const char * a2dp_codec_to_string(uint32_t codec) {
-	for (size_t i = 0; i < ARRAYSIZE(codecs); i++)
-		if (codecs[i].codec == codec)
-			return codecs[i].aliases[0];
-	return NULL;
+	ssize_t i;
+	if ((i = a2dp_codec_lookup_id(codec)) == -1)
+		return NULL;
+	return codecs[i].aliases[0];
 }
 
 const char * a2dp_codec_canonical_name(const char * alias) {
-	for (size_t i = 0; i < ARRAYSIZE(codecs); i++)
-		for (size_t n = 0; n < ARRAYSIZE(codecs[i].aliases); n++)
-			if (codecs[i].aliases[n] != NULL &&
-					strcasecmp(codecs[i].aliases[n], alias) == 0)
-				return codecs[i].aliases[0];
-	return alias;
+	ssize_t i;
+	if ((i = a2dp_codec_lookup_alias(alias)) == -1)
+		return alias;
+	return codecs[i].aliases[0];
 }
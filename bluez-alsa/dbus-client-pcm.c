@@ -35,10 +35,74 @@ static int path2ba(const char *path, bdaddr_t *ba) {
 	return 0;
 }
 
-dbus_bool_t ba_dbus_pcm_get_all(
+/**
+ * BlueALSA PCM object path profile components. */
+static const struct {
+	unsigned int transport;
+	const char *name;
+} ba_pcm_profiles[] = {
+	{ BA_PCM_TRANSPORT_A2DP_SOURCE, "a2dpsrc" },
+	{ BA_PCM_TRANSPORT_A2DP_SINK, "a2dpsnk" },
+	{ BA_PCM_TRANSPORT_HFP_AG, "hfpag" },
+	{ BA_PCM_TRANSPORT_HFP_HF, "hfphf" },
+	{ BA_PCM_TRANSPORT_HSP_AG, "hspag" },
+	{ BA_PCM_TRANSPORT_HSP_HS, "hsphs" },
+};
+
+/**
+ * Check whether a BlueALSA object path may refer to a PCM of the given device
+ * (NULL for any device), transports and mode (0 for any mode), so that other
+ * objects can be rejected without decoding their properties. Paths which do
+ * not follow the expected layout are never rejected.
+ *
+ * The layout is /org/bluealsa/hciX/dev_XX_XX_XX_XX_XX_XX/PROFILE/MODE */
+static bool ba_dbus_pcm_path_match(
+		const char *path,
+		const bdaddr_t *addr,
+		unsigned int transports,
+		unsigned int mode) {
+
+	bdaddr_t path_addr;
+	if (addr != NULL && path2ba(path, &path_addr) == 0 &&
+			bacmp(&path_addr, addr) != 0)
+		return false;
+
+	const char *mode_name;
+	if ((mode_name = strrchr(path, '/')) == NULL)
+		return true;
+	mode_name++;
+
+	if (mode == BA_PCM_MODE_SINK && strcmp(mode_name, "source") == 0)
+		return false;
+	if (mode == BA_PCM_MODE_SOURCE && strcmp(mode_name, "sink") == 0)
+		return false;
+
+	const char *profile = mode_name - 1;
+	while (profile > path && profile[-1] != '/')
+		profile--;
+
+	const size_t len = mode_name - 1 - profile;
+	for (size_t i = 0; i < ARRAYSIZE(ba_pcm_profiles); i++)
+		if (strlen(ba_pcm_profiles[i].name) == len &&
+				strncmp(profile, ba_pcm_profiles[i].name, len) == 0)
+			return ba_pcm_profiles[i].transport & transports;
+
+	return true;
+}
+
+/**
+ * Visit the BlueALSA PCMs in a single GetManagedObjects reply.
+ *
+ * The filter callback, if given, is called with the object path of each
+ * object before anything else is decoded; objects for which it returns FALSE
+ * are skipped unparsed. The properties of the remaining objects are decoded
+ * on the stack and passed to the visitor callback, which may return FALSE to
+ * stop the iteration early. Nothing is allocated for rejected objects. */
+dbus_bool_t ba_dbus_pcm_foreach(
 		struct ba_dbus_ctx *ctx,
-		struct ba_pcm **pcms,
-		size_t *length,
+		dbus_bool_t (*filter)(const char *path, void *data),
+		dbus_bool_t (*cb)(const struct ba_pcm *pcm, void *data),
+		void *userdata,
 		DBusError *error) {
 
 	DBusMessage *msg;
@@ -48,13 +112,10 @@ dbus_bool_t ba_dbus_pcm_get_all(
 		return FALSE;
 	}
 
-	dbus_bool_t rv = TRUE;
-	struct ba_pcm *_pcms = NULL;
-	size_t _length = 0;
+	dbus_bool_t rv = FALSE;
 
 	DBusMessage *rep;
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL)
+	if ((rep = ba_dbus_call(ctx, msg, error)) == NULL)
 		goto fail;
 
 	DBusMessageIter iter;
@@ -68,7 +129,10 @@ dbus_bool_t ba_dbus_pcm_get_all(
 			dbus_message_iter_get_arg_type(&iter_objects) != DBUS_TYPE_INVALID;
 			dbus_message_iter_next(&iter_objects)) {
 
-		if (dbus_message_iter_get_arg_type(&iter_objects) != DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter iter_object_entry;
+		if (dbus_message_iter_get_arg_type(&iter_objects) != DBUS_TYPE_DICT_ENTRY ||
+				(dbus_message_iter_recurse(&iter_objects, &iter_object_entry),
+				 dbus_message_iter_get_arg_type(&iter_object_entry) != DBUS_TYPE_OBJECT_PATH)) {
 			char *signature = dbus_message_iter_get_signature(&iter);
 			dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
 					"Incorrect signature: %s != a{oa{sa{sv}}}", signature);
@@ -76,8 +140,12 @@ dbus_bool_t ba_dbus_pcm_get_all(
 			goto fail;
 		}
 
-		DBusMessageIter iter_object_entry;
-		dbus_message_iter_recurse(&iter_objects, &iter_object_entry);
+		if (filter != NULL) {
+			const char *path;
+			dbus_message_iter_get_basic(&iter_object_entry, &path);
+			if (!filter(path, userdata))
+				continue;
+		}
 
 		struct ba_pcm pcm;
 		DBusError err = DBUS_ERROR_INIT;
@@ -90,32 +158,262 @@ dbus_bool_t ba_dbus_pcm_get_all(
 		if (pcm.transport == BA_PCM_TRANSPORT_NONE)
 			continue;
 
-		struct ba_pcm *tmp = _pcms;
-		if ((tmp = realloc(tmp, (_length + 1) * sizeof(*tmp))) == NULL) {
-			dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
+		if (!cb(&pcm, userdata))
+			break;
+
+	}
+
+	rv = TRUE;
+
+fail:
+	if (rep != NULL)
+		dbus_message_unref(rep);
+	dbus_message_unref(msg);
+	return rv;
+}
+
+struct ba_dbus_pcm_get_all_data {
+	struct ba_pcm *pcms;
+	size_t length;
+	size_t size;
+	bool failed;
+};
+
+static dbus_bool_t ba_dbus_pcm_get_all_cb(const struct ba_pcm *pcm, void *data) {
+	struct ba_dbus_pcm_get_all_data *d = data;
+
+	if (d->length == d->size) {
+		size_t size = d->size == 0 ? 16 : d->size * 2;
+		struct ba_pcm *tmp = d->pcms;
+		if ((tmp = realloc(tmp, size * sizeof(*tmp))) == NULL) {
+			d->failed = true;
+			return FALSE;
+		}
+		d->pcms = tmp;
+		d->size = size;
+	}
+
+	memcpy(&d->pcms[d->length++], pcm, sizeof(*pcm));
+	return TRUE;
+}
+
+dbus_bool_t ba_dbus_pcm_get_all(
+		struct ba_dbus_ctx *ctx,
+		struct ba_pcm **pcms,
+		size_t *length,
+		DBusError *error) {
+
+	struct ba_dbus_pcm_get_all_data data = { 0 };
+
+	if (!ba_dbus_pcm_foreach(ctx, NULL, ba_dbus_pcm_get_all_cb, &data, error)) {
+		free(data.pcms);
+		return FALSE;
+	}
+
+	if (data.failed) {
+		free(data.pcms);
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	*pcms = data.pcms;
+	*length = data.length;
+	return TRUE;
+}
+
+static dbus_bool_t dbus_message_iter_get_ba_pcm_props_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error);
+
+/**
+ * Callback function for manager object adapters property parser. */
+static dbus_bool_t ba_dbus_message_iter_get_adapters_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error) {
+	/* Decode the adapters only, the other manager object properties
+	 * would have to be freed afterwards. */
+	return dbus_message_iter_dict_props(key, value,
+			&ba_dbus_manager_prop_adapters, userdata, error);
+}
+
+/**
+ * Check whether the error indicates that the service is not responding. */
+static bool dbus_error_is_unresponsive(
+		const DBusError *error) {
+	return dbus_error_has_name(error, DBUS_ERROR_NO_REPLY) ||
+		dbus_error_has_name(error, DBUS_ERROR_TIMEOUT) ||
+		dbus_error_has_name(error, DBUS_ERROR_SERVICE_UNKNOWN);
+}
+
+/**
+ * Get BlueALSA PCMs for the given device without enumerating all objects.
+ *
+ * The BlueALSA PCM object path is constructed from the adapter, the device
+ * address, the transport profile and the stream mode, so we can query the
+ * expected objects directly. The queries for all candidate paths are sent at
+ * once, so the lookup takes a single round trip. Either of the source and
+ * sink PCM may be NULL if not wanted; a PCM which is not found has its
+ * transport set to BA_PCM_TRANSPORT_NONE. A "not found" error is returned if
+ * none of the candidate paths resolves to a matching PCM. */
+static dbus_bool_t ba_dbus_pcm_get_direct(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int transports,
+		struct ba_pcm *source,
+		struct ba_pcm *sink,
+		DBusError *error) {
+
+	const struct {
+		unsigned int mode;
+		const char *name;
+		struct ba_pcm *pcm;
+	} modes[] = {
+		{ BA_PCM_MODE_SOURCE, "source", source },
+		{ BA_PCM_MODE_SINK, "sink", sink },
+	};
+
+	struct candidate {
+		DBusPendingCall *pending;
+		struct ba_pcm *pcm;
+		unsigned int mode;
+		char path[sizeof(((struct ba_pcm *)0)->pcm_path)];
+	} *candidates = NULL;
+	size_t candidates_len = 0;
+
+	DBusError err = DBUS_ERROR_INIT;
+	struct ba_service_props props = { 0 };
+	unsigned int wanted = 0;
+	size_t i = 0;
+
+	for (size_t m = 0; m < ARRAYSIZE(modes); m++)
+		if (modes[m].pcm != NULL) {
+			modes[m].pcm->transport = BA_PCM_TRANSPORT_NONE;
+			wanted |= modes[m].mode;
+		}
+
+	if (!ba_dbus_props_get_all(ctx, "/org/bluealsa", BLUEALSA_INTERFACE_MANAGER,
+				&err, ba_dbus_message_iter_get_adapters_cb, &props)) {
+		if (dbus_error_is_unresponsive(&err))
 			goto fail;
+		dbus_error_free(&err);
+		goto notfound;
+	}
+
+	if ((candidates = malloc(props.adapters_len * ARRAYSIZE(ba_pcm_profiles) *
+					ARRAYSIZE(modes) * sizeof(*candidates))) == NULL) {
+		dbus_set_error_const(&err, DBUS_ERROR_NO_MEMORY, NULL);
+		goto fail;
+	}
+
+	for (size_t a = 0; a < props.adapters_len; a++)
+		for (size_t n = 0; n < ARRAYSIZE(ba_pcm_profiles); n++)
+			for (size_t m = 0; m < ARRAYSIZE(modes); m++) {
+
+				if (!(ba_pcm_profiles[n].transport & transports) || modes[m].pcm == NULL)
+					continue;
+
+				char *path = candidates[candidates_len].path;
+				snprintf(path, sizeof(candidates[candidates_len].path),
+						"/org/bluealsa/%s/dev_%.2X_%.2X_%.2X_%.2X_%.2X_%.2X/%s/%s",
+						props.adapters[a],
+						addr->b[5], addr->b[4], addr->b[3],
+						addr->b[2], addr->b[1], addr->b[0],
+						ba_pcm_profiles[n].name, modes[m].name);
+
+				if (!ba_dbus_props_get_all_start(ctx, path, BLUEALSA_INTERFACE_PCM,
+							&candidates[candidates_len].pending, &err))
+					goto fail;
+
+				candidates[candidates_len].pcm = modes[m].pcm;
+				candidates[candidates_len].mode = modes[m].mode;
+				candidates_len++;
+
+			}
+
+	unsigned int found = 0;
+	for (i = 0; i < candidates_len && found != wanted; i++) {
+
+		struct ba_pcm pcm = { 0 };
+		strcpy(pcm.pcm_path, candidates[i].path);
+
+		if (!ba_dbus_props_get_all_finish(candidates[i].pending, &err,
+					dbus_message_iter_get_ba_pcm_props_cb, &pcm)) {
+			/* Do not wait for other replies if the service is not responding. */
+			if (dbus_error_is_unresponsive(&err)) {
+				i++;
+				goto fail;
+			}
+			dbus_error_free(&err);
+			continue;
 		}
 
-		_pcms = tmp;
+		if (!(found & candidates[i].mode) &&
+				bacmp(&pcm.addr, addr) == 0 &&
+				pcm.transport & transports &&
+				pcm.mode == candidates[i].mode) {
+			memcpy(candidates[i].pcm, &pcm, sizeof(pcm));
+			found |= candidates[i].mode;
+		}
 
-		memcpy(&_pcms[_length++], &pcm, sizeof(*_pcms));
+	}
 
+	/* Discard the replies we no longer need. */
+	for (; i < candidates_len; i++) {
+		dbus_pending_call_cancel(candidates[i].pending);
+		dbus_pending_call_unref(candidates[i].pending);
 	}
 
-	*pcms = _pcms;
-	*length = _length;
+	free(candidates);
 
-	goto success;
+	if (found != 0)
+		return TRUE;
+
+notfound:
+	dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+	return FALSE;
 
 fail:
-	free(_pcms);
-	rv = FALSE;
+	for (; i < candidates_len; i++) {
+		dbus_pending_call_cancel(candidates[i].pending);
+		dbus_pending_call_unref(candidates[i].pending);
+	}
+	free(candidates);
+	dbus_move_error(&err, error);
+	return FALSE;
+}
 
-success:
-	if (rep != NULL)
-		dbus_message_unref(rep);
-	dbus_message_unref(msg);
-	return rv;
+struct ba_dbus_pcm_get_data {
+	const bdaddr_t *addr;
+	unsigned int transports;
+	unsigned int mode;
+	struct ba_pcm *pcm;
+	bool found;
+};
+
+static dbus_bool_t ba_dbus_pcm_get_filter(const char *path, void *data) {
+	const struct ba_dbus_pcm_get_data *d = data;
+	return ba_dbus_pcm_path_match(path, d->addr, d->transports, d->mode);
+}
+
+static dbus_bool_t ba_dbus_pcm_get_cb(const struct ba_pcm *pcm, void *data) {
+	struct ba_dbus_pcm_get_data *d = data;
+
+	if (!(pcm->transport & d->transports) || pcm->mode != d->mode)
+		return TRUE;
+
+	if (d->addr == NULL) {
+		/* Looking for the most recently connected PCM. */
+		if (!d->found || pcm->sequence >= d->pcm->sequence) {
+			memcpy(d->pcm, pcm, sizeof(*pcm));
+			d->found = true;
+		}
+		return TRUE;
+	}
+
+	if (bacmp(&pcm->addr, d->addr) != 0)
+		return TRUE;
+
+	memcpy(d->pcm, pcm, sizeof(*pcm));
+	d->found = true;
+	return FALSE;
 }
 
 dbus_bool_t ba_dbus_pcm_get(
@@ -127,41 +425,112 @@ dbus_bool_t ba_dbus_pcm_get(
 		DBusError *error) {
 
 	const bool get_last = bacmp(addr, BDADDR_ANY) == 0;
-	struct ba_pcm *pcms = NULL;
-	struct ba_pcm *match = NULL;
-	dbus_bool_t rv = TRUE;
-	size_t length = 0;
-	uint32_t seq = 0;
 
-	if (!ba_dbus_pcm_get_all(ctx, &pcms, &length, error))
+	if (!get_last) {
+		/* Try the direct lookup first, and only fall back to enumerating
+		 * all BlueALSA objects if the expected PCM path does not exist. */
+		DBusError err = DBUS_ERROR_INIT;
+		if (ba_dbus_pcm_get_direct(ctx, addr, transports,
+					mode == BA_PCM_MODE_SOURCE ? pcm : NULL,
+					mode == BA_PCM_MODE_SINK ? pcm : NULL, &err))
+			return TRUE;
+		if (!dbus_error_has_name(&err, DBUS_ERROR_FILE_NOT_FOUND)) {
+			dbus_move_error(&err, error);
+			return FALSE;
+		}
+		dbus_error_free(&err);
+	}
+
+	struct ba_dbus_pcm_get_data data = {
+		.addr = get_last ? NULL : addr,
+		.transports = transports,
+		.mode = mode,
+		.pcm = pcm,
+	};
+
+	if (!ba_dbus_pcm_foreach(ctx, ba_dbus_pcm_get_filter,
+				ba_dbus_pcm_get_cb, &data, error))
 		return FALSE;
 
-	for (size_t i = 0; i < length; i++) {
-		if (get_last) {
-			if (pcms[i].sequence >= seq &&
-					pcms[i].transport & transports &&
-					pcms[i].mode == mode) {
-				seq = pcms[i].sequence;
-				match = &pcms[i];
-			}
-		}
-		else if (bacmp(&pcms[i].addr, addr) == 0 &&
-				pcms[i].transport & transports &&
-				pcms[i].mode == mode) {
-			match = &pcms[i];
-			break;
-		}
+	if (!data.found) {
+		dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+		return FALSE;
 	}
 
-	if (match != NULL)
-		memcpy(pcm, match, sizeof(*pcm));
-	else {
+	return TRUE;
+}
+
+struct ba_dbus_pcm_get_pair_data {
+	const bdaddr_t *addr;
+	unsigned int transports;
+	struct ba_pcm *source;
+	struct ba_pcm *sink;
+};
+
+static dbus_bool_t ba_dbus_pcm_get_pair_filter(const char *path, void *data) {
+	const struct ba_dbus_pcm_get_pair_data *d = data;
+	return ba_dbus_pcm_path_match(path, d->addr, d->transports, 0);
+}
+
+static dbus_bool_t ba_dbus_pcm_get_pair_cb(const struct ba_pcm *pcm, void *data) {
+	struct ba_dbus_pcm_get_pair_data *d = data;
+
+	if (bacmp(&pcm->addr, d->addr) != 0 || !(pcm->transport & d->transports))
+		return TRUE;
+
+	if (pcm->mode == BA_PCM_MODE_SOURCE && d->source->transport == BA_PCM_TRANSPORT_NONE)
+		memcpy(d->source, pcm, sizeof(*pcm));
+	if (pcm->mode == BA_PCM_MODE_SINK && d->sink->transport == BA_PCM_TRANSPORT_NONE)
+		memcpy(d->sink, pcm, sizeof(*pcm));
+
+	/* Stop once both have been found. */
+	return d->source->transport == BA_PCM_TRANSPORT_NONE ||
+		d->sink->transport == BA_PCM_TRANSPORT_NONE;
+}
+
+/**
+ * Get both the source and the sink BlueALSA PCM of the given device with a
+ * single lookup. A PCM which does not exist has its transport set to
+ * BA_PCM_TRANSPORT_NONE. A "not found" error is returned if the device has
+ * neither PCM. */
+dbus_bool_t ba_dbus_pcm_get_pair(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int transports,
+		struct ba_pcm *source,
+		struct ba_pcm *sink,
+		DBusError *error) {
+
+	DBusError err = DBUS_ERROR_INIT;
+	if (ba_dbus_pcm_get_direct(ctx, addr, transports, source, sink, &err))
+		return TRUE;
+	if (!dbus_error_has_name(&err, DBUS_ERROR_FILE_NOT_FOUND)) {
+		dbus_move_error(&err, error);
+		return FALSE;
+	}
+	dbus_error_free(&err);
+
+	struct ba_dbus_pcm_get_pair_data data = {
+		.addr = addr,
+		.transports = transports,
+		.source = source,
+		.sink = sink,
+	};
+
+	source->transport = BA_PCM_TRANSPORT_NONE;
+	sink->transport = BA_PCM_TRANSPORT_NONE;
+
+	if (!ba_dbus_pcm_foreach(ctx, ba_dbus_pcm_get_pair_filter,
+				ba_dbus_pcm_get_pair_cb, &data, error))
+		return FALSE;
+
+	if (source->transport == BA_PCM_TRANSPORT_NONE &&
+			sink->transport == BA_PCM_TRANSPORT_NONE) {
 		dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
-		rv = FALSE;
+		return FALSE;
 	}
 
-	free(pcms);
-	return rv;
+	return TRUE;
 }
 
 /**
@@ -181,8 +550,7 @@ dbus_bool_t ba_dbus_pcm_open(
 	}
 
 	DBusMessage *rep;
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL) {
+	if ((rep = ba_dbus_call(ctx, msg, error)) == NULL) {
 		dbus_message_unref(msg);
 		return FALSE;
 	}
@@ -266,14 +634,17 @@ static void dbus_message_iter_get_codec_channel_maps(
 	size_t i;
 	DBusMessageIter iter_array;
 	for (dbus_message_iter_recurse(variant, &iter_array), i = 0;
-			dbus_message_iter_get_arg_type(&iter_array) != DBUS_TYPE_INVALID;
+			dbus_message_iter_get_arg_type(&iter_array) != DBUS_TYPE_INVALID &&
+				i < ARRAYSIZE(codec->channel_maps);
 			dbus_message_iter_next(&iter_array)) {
 
 		const char *data[ARRAYSIZE(*codec->channel_maps)];
 		size_t length = ARRAYSIZE(data);
 
-		dbus_message_iter_array_get_strings(&iter_array, NULL, data, &length);
+		if (!dbus_message_iter_array_get_strings(&iter_array, NULL, data, &length))
+			length = 0;
 
+		length = MIN(length, ARRAYSIZE(data));
 		for (size_t j = 0; j < length; j++)
 			strncpy(codec->channel_maps[i][j], data[j], sizeof(codec->channel_maps[i][j]) - 1);
 
@@ -282,52 +653,76 @@ static void dbus_message_iter_get_codec_channel_maps(
 
 }
 
-/**
- * Callback function for BlueALSA PCM codec props parser. */
-static dbus_bool_t ba_dbus_message_iter_pcm_codec_get_props_cb(const char *key,
-		DBusMessageIter *value, void *userdata, DBusError *error) {
-	struct ba_pcm_codec *codec = (struct ba_pcm_codec *)userdata;
+static dbus_bool_t ba_dbus_codec_set_capabilities(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	(void)error;
+	dbus_message_iter_get_codec_data(variant, userdata);
+	return TRUE;
+}
 
-	char type;
-	if ((type = dbus_message_iter_get_arg_type(value)) != DBUS_TYPE_VARIANT) {
-		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-				"Incorrect property value type: %c != %c", type, DBUS_TYPE_VARIANT);
-		return FALSE;
-	}
+static dbus_bool_t ba_dbus_codec_set_channels(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	(void)error;
+	dbus_message_iter_get_codec_channels(variant, userdata);
+	return TRUE;
+}
 
-	DBusMessageIter variant;
-	dbus_message_iter_recurse(value, &variant);
-	type = dbus_message_iter_get_arg_type(&variant);
+static dbus_bool_t ba_dbus_codec_set_channel_maps(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	(void)error;
+	dbus_message_iter_get_codec_channel_maps(variant, userdata);
+	return TRUE;
+}
 
-	char type_expected;
+static dbus_bool_t ba_dbus_codec_set_rates(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	(void)error;
+	dbus_message_iter_get_codec_rates(variant, userdata);
+	return TRUE;
+}
 
-	if (strcmp(key, "Capabilities") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
-		dbus_message_iter_get_codec_data(&variant, codec);
-	}
-	else if (strcmp(key, "Channels") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
-		dbus_message_iter_get_codec_channels(&variant, codec);
-	}
-	else if (strcmp(key, "ChannelMaps") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
-		dbus_message_iter_get_codec_channel_maps(&variant, codec);
-	}
-	else if (strcmp(key, "Rates") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
-		dbus_message_iter_get_codec_rates(&variant, codec);
-	}
+enum {
+	BA_DBUS_CODEC_PROP_CAPABILITIES,
+	BA_DBUS_CODEC_PROP_CHANNELS,
+	BA_DBUS_CODEC_PROP_CHANNEL_MAPS,
+	BA_DBUS_CODEC_PROP_RATES,
+};
 
-	return TRUE;
+/**
+ * BlueALSA PCM codec properties. */
+static const struct ba_dbus_prop ba_dbus_codec_props[] = {
+	[BA_DBUS_CODEC_PROP_CAPABILITIES] =
+		BA_DBUS_PROP("Capabilities", DBUS_TYPE_ARRAY, ba_dbus_codec_set_capabilities),
+	[BA_DBUS_CODEC_PROP_CHANNELS] =
+		BA_DBUS_PROP("Channels", DBUS_TYPE_ARRAY, ba_dbus_codec_set_channels),
+	[BA_DBUS_CODEC_PROP_CHANNEL_MAPS] =
+		BA_DBUS_PROP("ChannelMaps", DBUS_TYPE_ARRAY, ba_dbus_codec_set_channel_maps),
+	[BA_DBUS_CODEC_PROP_RATES] =
+		BA_DBUS_PROP("Rates", DBUS_TYPE_ARRAY, ba_dbus_codec_set_rates),
+};
 
-fail:
-	dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-			"Incorrect variant for '%s': %c != %c", key, type, type_expected);
-	return FALSE;
+/**
+ * Select the codec property candidate for the given key. */
+static const struct ba_dbus_prop *ba_dbus_codec_prop_find(const char *key) {
+	switch (strlen(key)) {
+	case 5:
+		return &ba_dbus_codec_props[BA_DBUS_CODEC_PROP_RATES];
+	case 8:
+		return &ba_dbus_codec_props[BA_DBUS_CODEC_PROP_CHANNELS];
+	case 11:
+		return &ba_dbus_codec_props[BA_DBUS_CODEC_PROP_CHANNEL_MAPS];
+	case 12:
+		return &ba_dbus_codec_props[BA_DBUS_CODEC_PROP_CAPABILITIES];
+	}
+	return NULL;
+}
+
+/**
+ * Callback function for BlueALSA PCM codec props parser. */
+static dbus_bool_t ba_dbus_message_iter_pcm_codec_get_props_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error) {
+	return dbus_message_iter_dict_props(key, value,
+			ba_dbus_codec_prop_find(key), userdata, error);
 }
 
 /**
@@ -376,8 +771,7 @@ dbus_bool_t ba_dbus_pcm_codecs_get(
 		goto fail;
 	}
 
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL)
+	if ((rep = ba_dbus_call(ctx, msg, error)) == NULL)
 		goto fail;
 
 	DBusMessageIter iter;
@@ -493,8 +887,7 @@ dbus_bool_t ba_dbus_pcm_select_codec(
 		goto fail;
 	}
 
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL)
+	if ((rep = ba_dbus_call(ctx, msg, error)) == NULL)
 		goto fail;
 
 	rv = TRUE;
@@ -692,151 +1085,300 @@ fail:
 	return FALSE;
 }
 
-/**
- * Callback function for BlueALSA PCM properties parser. */
-static dbus_bool_t dbus_message_iter_get_ba_pcm_props_cb(const char *key,
-		DBusMessageIter *value, void *userdata, DBusError *error) {
-	struct ba_pcm *pcm = (struct ba_pcm *)userdata;
+static dbus_bool_t ba_dbus_pcm_set_device(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+
+	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+	strncpy(pcm->device_path, tmp, sizeof(pcm->device_path) - 1);
+	path2ba(tmp, &pcm->addr);
+
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_sequence(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->sequence);
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_transport(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+
+	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+
+	if (strstr(tmp, "A2DP-source") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_A2DP_SOURCE;
+	else if (strstr(tmp, "A2DP-sink") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_A2DP_SINK;
+	else if (strstr(tmp, "ASHA-source") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_ASHA_SOURCE;
+	else if (strstr(tmp, "ASHA-sink") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_ASHA_SINK;
+	else if (strstr(tmp, "HFP-AG") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_HFP_AG;
+	else if (strstr(tmp, "HFP-HF") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_HFP_HF;
+	else if (strstr(tmp, "HSP-AG") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_HSP_AG;
+	else if (strstr(tmp, "HSP-HS") != NULL)
+		pcm->transport = BA_PCM_TRANSPORT_HSP_HS;
+
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_mode(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+
+	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+
+	if (strcmp(tmp, "source") == 0)
+		pcm->mode = BA_PCM_MODE_SOURCE;
+	else if (strcmp(tmp, "sink") == 0)
+		pcm->mode = BA_PCM_MODE_SINK;
 
-	char type;
-	if ((type = dbus_message_iter_get_arg_type(value)) != DBUS_TYPE_VARIANT) {
-		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-				"Incorrect property value type: %c != %c", type, DBUS_TYPE_VARIANT);
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_running(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->running);
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_format(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->format);
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_channels(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->channels);
+	pcm->codec.channels[0] = pcm->channels;
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_channel_map(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+
+	const char *data[ARRAYSIZE(pcm->channel_map)];
+	size_t length = ARRAYSIZE(data);
+
+	if (!dbus_message_iter_array_get_strings(variant, error, data, &length))
 		return FALSE;
-	}
 
-	DBusMessageIter variant;
-	dbus_message_iter_recurse(value, &variant);
-	type = dbus_message_iter_get_arg_type(&variant);
+	length = MIN(length, ARRAYSIZE(data));
+	for (size_t i = 0; i < length; i++)
+		strncpy(pcm->channel_map[i], data[i], sizeof(pcm->channel_map[i]) - 1);
+
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_rate(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->rate);
+	pcm->codec.rates[0] = pcm->rate;
+	return TRUE;
+}
+
+static dbus_bool_t ba_dbus_pcm_set_codec(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
 
-	char type_expected;
 	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+	strncpy(pcm->codec.name, tmp, sizeof(pcm->codec.name) - 1);
 
-	if (strcmp(key, "Device") == 0) {
-		if (type != (type_expected = DBUS_TYPE_OBJECT_PATH))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		strncpy(pcm->device_path, tmp, sizeof(pcm->device_path) - 1);
-		path2ba(tmp, &pcm->addr);
-	}
-	else if (strcmp(key, "Sequence") == 0) {
-		if (type != (type_expected = DBUS_TYPE_UINT32))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->sequence);
-	}
-	else if (strcmp(key, "Transport") == 0) {
-		if (type != (type_expected = DBUS_TYPE_STRING))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		if (strstr(tmp, "A2DP-source") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_A2DP_SOURCE;
-		else if (strstr(tmp, "A2DP-sink") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_A2DP_SINK;
-		else if (strstr(tmp, "ASHA-source") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_ASHA_SOURCE;
-		else if (strstr(tmp, "ASHA-sink") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_ASHA_SINK;
-		else if (strstr(tmp, "HFP-AG") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_HFP_AG;
-		else if (strstr(tmp, "HFP-HF") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_HFP_HF;
-		else if (strstr(tmp, "HSP-AG") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_HSP_AG;
-		else if (strstr(tmp, "HSP-HS") != NULL)
-			pcm->transport = BA_PCM_TRANSPORT_HSP_HS;
-	}
-	else if (strcmp(key, "Mode") == 0) {
-		if (type != (type_expected = DBUS_TYPE_STRING))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		if (strcmp(tmp, "source") == 0)
-			pcm->mode = BA_PCM_MODE_SOURCE;
-		else if (strcmp(tmp, "sink") == 0)
-			pcm->mode = BA_PCM_MODE_SINK;
-	}
-	else if (strcmp(key, "Running") == 0) {
-		if (type != (type_expected = DBUS_TYPE_BOOLEAN))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->running);
-	}
-	else if (strcmp(key, "Format") == 0) {
-		if (type != (type_expected = DBUS_TYPE_UINT16))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->format);
-	}
-	else if (strcmp(key, "Channels") == 0) {
-		if (type != (type_expected = DBUS_TYPE_BYTE))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->channels);
-		pcm->codec.channels[0] = pcm->channels;
-	}
-	else if (strcmp(key, "ChannelMap") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+	return TRUE;
+}
 
-		const char *data[ARRAYSIZE(pcm->channel_map)];
-		size_t length = ARRAYSIZE(data);
+static dbus_bool_t ba_dbus_pcm_set_codec_config(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_codec_data(variant, &pcm->codec);
+	return TRUE;
+}
 
-		if (!dbus_message_iter_array_get_strings(&variant, error, data, &length))
-			return FALSE;
+static dbus_bool_t ba_dbus_pcm_set_delay(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->delay);
+	return TRUE;
+}
 
-		for (size_t i = 0; i < length; i++)
-			strncpy(pcm->channel_map[i], data[i], sizeof(pcm->channel_map[i]) - 1);
+static dbus_bool_t ba_dbus_pcm_set_client_delay(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->client_delay);
+	return TRUE;
+}
 
-	}
-	else if (strcmp(key, "Rate") == 0) {
-		if (type != (type_expected = DBUS_TYPE_UINT32))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->rate);
-		pcm->codec.rates[0] = pcm->rate;
-	}
-	else if (strcmp(key, "Codec") == 0) {
-		if (type != (type_expected = DBUS_TYPE_STRING))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		strncpy(pcm->codec.name, tmp, sizeof(pcm->codec.name) - 1);
-	}
-	else if (strcmp(key, "CodecConfiguration") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
-		dbus_message_iter_get_codec_data(&variant, &pcm->codec);
-	}
-	else if (strcmp(key, "Delay") == 0) {
-		if (type != (type_expected = DBUS_TYPE_UINT16))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->delay);
-	}
-	else if (strcmp(key, "ClientDelay") == 0) {
-		if (type != (type_expected = DBUS_TYPE_INT16))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->client_delay);
-	}
-	else if (strcmp(key, "SoftVolume") == 0) {
-		if (type != (type_expected = DBUS_TYPE_BOOLEAN))
-			goto fail;
-		dbus_message_iter_get_basic(&variant, &pcm->soft_volume);
-	}
-	else if (strcmp(key, "Volume") == 0) {
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+static dbus_bool_t ba_dbus_pcm_set_soft_volume(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
+	dbus_message_iter_get_basic(variant, &pcm->soft_volume);
+	return TRUE;
+}
 
-		DBusMessageIter iter;
-		uint8_t *data;
-		int len;
+static dbus_bool_t ba_dbus_pcm_set_volume(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_pcm *pcm = userdata;
+	(void)error;
 
-		dbus_message_iter_recurse(&variant, &iter);
-		dbus_message_iter_get_fixed_array(&iter, &data, &len);
+	DBusMessageIter iter;
+	uint8_t *data;
+	int len;
 
-		memcpy(pcm->volume, data, MIN(len, ARRAYSIZE(pcm->volume)));
+	dbus_message_iter_recurse(variant, &iter);
+	dbus_message_iter_get_fixed_array(&iter, &data, &len);
 
-	}
+	memcpy(pcm->volume, data, MIN(len, ARRAYSIZE(pcm->volume)));
 
 	return TRUE;
+}
 
-fail:
-	dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-			"Incorrect variant for '%s': %c != %c", key, type, type_expected);
-	return FALSE;
+enum {
+	BA_DBUS_PCM_PROP_DEVICE,
+	BA_DBUS_PCM_PROP_SEQUENCE,
+	BA_DBUS_PCM_PROP_TRANSPORT,
+	BA_DBUS_PCM_PROP_MODE,
+	BA_DBUS_PCM_PROP_RUNNING,
+	BA_DBUS_PCM_PROP_FORMAT,
+	BA_DBUS_PCM_PROP_CHANNELS,
+	BA_DBUS_PCM_PROP_CHANNEL_MAP,
+	BA_DBUS_PCM_PROP_RATE,
+	BA_DBUS_PCM_PROP_CODEC,
+	BA_DBUS_PCM_PROP_CODEC_CONFIG,
+	BA_DBUS_PCM_PROP_DELAY,
+	BA_DBUS_PCM_PROP_CLIENT_DELAY,
+	BA_DBUS_PCM_PROP_SOFT_VOLUME,
+	BA_DBUS_PCM_PROP_VOLUME,
+};
+
+/**
+ * BlueALSA PCM object properties. */
+static const struct ba_dbus_prop ba_dbus_pcm_props[] = {
+	[BA_DBUS_PCM_PROP_DEVICE] =
+		BA_DBUS_PROP("Device", DBUS_TYPE_OBJECT_PATH, ba_dbus_pcm_set_device),
+	[BA_DBUS_PCM_PROP_SEQUENCE] =
+		BA_DBUS_PROP("Sequence", DBUS_TYPE_UINT32, ba_dbus_pcm_set_sequence),
+	[BA_DBUS_PCM_PROP_TRANSPORT] =
+		BA_DBUS_PROP("Transport", DBUS_TYPE_STRING, ba_dbus_pcm_set_transport),
+	[BA_DBUS_PCM_PROP_MODE] =
+		BA_DBUS_PROP("Mode", DBUS_TYPE_STRING, ba_dbus_pcm_set_mode),
+	[BA_DBUS_PCM_PROP_RUNNING] =
+		BA_DBUS_PROP("Running", DBUS_TYPE_BOOLEAN, ba_dbus_pcm_set_running),
+	[BA_DBUS_PCM_PROP_FORMAT] =
+		BA_DBUS_PROP("Format", DBUS_TYPE_UINT16, ba_dbus_pcm_set_format),
+	[BA_DBUS_PCM_PROP_CHANNELS] =
+		BA_DBUS_PROP("Channels", DBUS_TYPE_BYTE, ba_dbus_pcm_set_channels),
+	[BA_DBUS_PCM_PROP_CHANNEL_MAP] =
+		BA_DBUS_PROP("ChannelMap", DBUS_TYPE_ARRAY, ba_dbus_pcm_set_channel_map),
+	[BA_DBUS_PCM_PROP_RATE] =
+		BA_DBUS_PROP("Rate", DBUS_TYPE_UINT32, ba_dbus_pcm_set_rate),
+	[BA_DBUS_PCM_PROP_CODEC] =
+		BA_DBUS_PROP("Codec", DBUS_TYPE_STRING, ba_dbus_pcm_set_codec),
+	[BA_DBUS_PCM_PROP_CODEC_CONFIG] =
+		BA_DBUS_PROP("CodecConfiguration", DBUS_TYPE_ARRAY, ba_dbus_pcm_set_codec_config),
+	[BA_DBUS_PCM_PROP_DELAY] =
+		BA_DBUS_PROP("Delay", DBUS_TYPE_UINT16, ba_dbus_pcm_set_delay),
+	[BA_DBUS_PCM_PROP_CLIENT_DELAY] =
+		BA_DBUS_PROP("ClientDelay", DBUS_TYPE_INT16, ba_dbus_pcm_set_client_delay),
+	[BA_DBUS_PCM_PROP_SOFT_VOLUME] =
+		BA_DBUS_PROP("SoftVolume", DBUS_TYPE_BOOLEAN, ba_dbus_pcm_set_soft_volume),
+	[BA_DBUS_PCM_PROP_VOLUME] =
+		BA_DBUS_PROP("Volume", DBUS_TYPE_ARRAY, ba_dbus_pcm_set_volume),
+};
+
+/**
+ * Select the PCM property candidate for the given key. */
+static const struct ba_dbus_prop *ba_dbus_pcm_prop_find(const char *key) {
+	switch (strlen(key)) {
+	case 4:
+		switch (key[0]) {
+		case 'M':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_MODE];
+		case 'R':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_RATE];
+		}
+		break;
+	case 5:
+		switch (key[0]) {
+		case 'C':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_CODEC];
+		case 'D':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_DELAY];
+		}
+		break;
+	case 6:
+		switch (key[0]) {
+		case 'D':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_DEVICE];
+		case 'F':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_FORMAT];
+		case 'V':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_VOLUME];
+		}
+		break;
+	case 7:
+		return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_RUNNING];
+	case 8:
+		switch (key[0]) {
+		case 'C':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_CHANNELS];
+		case 'S':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_SEQUENCE];
+		}
+		break;
+	case 9:
+		return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_TRANSPORT];
+	case 10:
+		switch (key[0]) {
+		case 'C':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_CHANNEL_MAP];
+		case 'S':
+			return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_SOFT_VOLUME];
+		}
+		break;
+	case 11:
+		return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_CLIENT_DELAY];
+	case 18:
+		return &ba_dbus_pcm_props[BA_DBUS_PCM_PROP_CODEC_CONFIG];
+	}
+	return NULL;
+}
+
+/**
+ * Callback function for BlueALSA PCM properties parser. */
+static dbus_bool_t dbus_message_iter_get_ba_pcm_props_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error) {
+	return dbus_message_iter_dict_props(key, value,
+			ba_dbus_pcm_prop_find(key), userdata, error);
 }
 
 /**
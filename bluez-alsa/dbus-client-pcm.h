@@ -158,6 +158,13 @@ struct ba_pcm {
 
 };
 
+dbus_bool_t ba_dbus_pcm_foreach(
+		struct ba_dbus_ctx *ctx,
+		dbus_bool_t (*filter)(const char *path, void *data),
+		dbus_bool_t (*cb)(const struct ba_pcm *pcm, void *data),
+		void *userdata,
+		DBusError *error);
+
 dbus_bool_t ba_dbus_pcm_get_all(
 		struct ba_dbus_ctx *ctx,
 		struct ba_pcm **pcms,
@@ -172,6 +179,14 @@ dbus_bool_t ba_dbus_pcm_get(
 		struct ba_pcm *pcm,
 		DBusError *error);
 
+dbus_bool_t ba_dbus_pcm_get_pair(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int transports,
+		struct ba_pcm *source,
+		struct ba_pcm *sink,
+		DBusError *error);
+
 dbus_bool_t ba_dbus_pcm_open(
 		struct ba_dbus_ctx *ctx,
 		const char *pcm_path,
@@ -12,68 +12,85 @@
 
 #include "defs.h"
 
-/**
- * Callback function for rfcomm object properties parser. */
-static dbus_bool_t ba_dbus_message_iter_rfcomm_props_get_cb(const char *key,
-		DBusMessageIter *value, void *userdata, DBusError *error) {
-	struct ba_rfcomm_props *props = (struct ba_rfcomm_props *)userdata;
-
-	char type;
-	if ((type = dbus_message_iter_get_arg_type(value)) != DBUS_TYPE_VARIANT) {
-		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-				"Incorrect property value type: %c != %c", type, DBUS_TYPE_VARIANT);
-		return FALSE;
-	}
+static dbus_bool_t ba_dbus_rfcomm_set_transport(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_rfcomm_props *props = userdata;
+	(void)error;
 
-	DBusMessageIter variant;
-	dbus_message_iter_recurse(value, &variant);
-	type = dbus_message_iter_get_arg_type(&variant);
+	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+	strncpy(props->transport, tmp, sizeof(props->transport) - 1);
 
-	char type_expected;
-
-	if (strcmp(key, "Transport") == 0) {
+	return TRUE;
+}
 
-		if (type != (type_expected = DBUS_TYPE_STRING))
-			goto fail;
+static dbus_bool_t ba_dbus_rfcomm_set_features(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_rfcomm_props *props = userdata;
 
-		const char *tmp;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		strncpy(props->transport, tmp, sizeof(props->transport) - 1);
+	const char *tmp[32];
+	size_t length = ARRAYSIZE(tmp);
+	if (!dbus_message_iter_array_get_strings(variant, error, tmp, &length))
+		return FALSE;
 
-	}
-	else if (strcmp(key, "Features") == 0) {
+	length = MIN(length, ARRAYSIZE(tmp));
+	props->features = malloc(length * sizeof(*props->features));
+	props->features_len = length;
+	for (size_t i = 0; i < length; i++)
+		props->features[i] = strdup(tmp[i]);
 
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+	return TRUE;
+}
 
-		const char *tmp[32];
-		size_t length = ARRAYSIZE(tmp);
-		if (!dbus_message_iter_array_get_strings(&variant, error, tmp, &length))
-			return FALSE;
+static dbus_bool_t ba_dbus_rfcomm_set_battery(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_rfcomm_props *props = userdata;
+	(void)error;
 
-		props->features = malloc(length * sizeof(*props->features));
-		props->features_len = MIN(length, ARRAYSIZE(tmp));
-		for (size_t i = 0; i < length; i++)
-			props->features[i] = strdup(tmp[i]);
+	signed char level;
+	dbus_message_iter_get_basic(variant, &level);
+	props->battery = level;
 
-	}
-	else if (strcmp(key, "Battery") == 0) {
+	return TRUE;
+}
 
-		if (type != (type_expected = DBUS_TYPE_BYTE))
-			goto fail;
+enum {
+	BA_DBUS_RFCOMM_PROP_TRANSPORT,
+	BA_DBUS_RFCOMM_PROP_FEATURES,
+	BA_DBUS_RFCOMM_PROP_BATTERY,
+};
 
-		signed char level;
-		dbus_message_iter_get_basic(&variant, &level);
-		props->battery = level;
+/**
+ * RFCOMM object properties. */
+static const struct ba_dbus_prop ba_dbus_rfcomm_props[] = {
+	[BA_DBUS_RFCOMM_PROP_TRANSPORT] =
+		BA_DBUS_PROP("Transport", DBUS_TYPE_STRING, ba_dbus_rfcomm_set_transport),
+	[BA_DBUS_RFCOMM_PROP_FEATURES] =
+		BA_DBUS_PROP("Features", DBUS_TYPE_ARRAY, ba_dbus_rfcomm_set_features),
+	[BA_DBUS_RFCOMM_PROP_BATTERY] =
+		BA_DBUS_PROP("Battery", DBUS_TYPE_BYTE, ba_dbus_rfcomm_set_battery),
+};
 
+/**
+ * Select the RFCOMM property candidate for the given key. */
+static const struct ba_dbus_prop *ba_dbus_rfcomm_prop_find(const char *key) {
+	switch (strlen(key)) {
+	case 7:
+		return &ba_dbus_rfcomm_props[BA_DBUS_RFCOMM_PROP_BATTERY];
+	case 8:
+		return &ba_dbus_rfcomm_props[BA_DBUS_RFCOMM_PROP_FEATURES];
+	case 9:
+		return &ba_dbus_rfcomm_props[BA_DBUS_RFCOMM_PROP_TRANSPORT];
 	}
+	return NULL;
+}
 
-	return TRUE;
-
-fail:
-	dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-			"Incorrect variant for '%s': %c != %c", key, type, type_expected);
-	return FALSE;
+/**
+ * Callback function for rfcomm object properties parser. */
+static dbus_bool_t ba_dbus_message_iter_rfcomm_props_get_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error) {
+	return dbus_message_iter_dict_props(key, value,
+			ba_dbus_rfcomm_prop_find(key), userdata, error);
 }
 
 /**
@@ -107,12 +124,10 @@ void ba_dbus_rfcomm_props_free(
 	}
 }
 
-/**
- * Open BlueALSA RFCOMM socket for dispatching AT commands. */
-dbus_bool_t ba_dbus_rfcomm_open(
+dbus_bool_t ba_dbus_rfcomm_open_start(
 		struct ba_dbus_ctx *ctx,
 		const char *rfcomm_path,
-		int *fd_rfcomm,
+		DBusPendingCall **pending,
 		DBusError *error) {
 
 	DBusMessage *msg;
@@ -122,12 +137,19 @@ dbus_bool_t ba_dbus_rfcomm_open(
 		return FALSE;
 	}
 
+	dbus_bool_t rv = ba_dbus_call_start(ctx, msg, pending, error);
+	dbus_message_unref(msg);
+	return rv;
+}
+
+dbus_bool_t ba_dbus_rfcomm_open_finish(
+		DBusPendingCall *pending,
+		int *fd_rfcomm,
+		DBusError *error) {
+
 	DBusMessage *rep;
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL) {
-		dbus_message_unref(msg);
+	if ((rep = ba_dbus_call_finish(pending, error)) == NULL)
 		return FALSE;
-	}
 
 	dbus_bool_t rv;
 	rv = dbus_message_get_args(rep, error,
@@ -135,6 +157,18 @@ dbus_bool_t ba_dbus_rfcomm_open(
 			DBUS_TYPE_INVALID);
 
 	dbus_message_unref(rep);
-	dbus_message_unref(msg);
 	return rv;
 }
+
+/**
+ * Open BlueALSA RFCOMM socket for dispatching AT commands. */
+dbus_bool_t ba_dbus_rfcomm_open(
+		struct ba_dbus_ctx *ctx,
+		const char *rfcomm_path,
+		int *fd_rfcomm,
+		DBusError *error) {
+	DBusPendingCall *pending;
+	if (!ba_dbus_rfcomm_open_start(ctx, rfcomm_path, &pending, error))
+		return FALSE;
+	return ba_dbus_rfcomm_open_finish(pending, fd_rfcomm, error);
+}
@@ -39,6 +39,17 @@ dbus_bool_t ba_dbus_rfcomm_props_get(
 void ba_dbus_rfcomm_props_free(
 		struct ba_rfcomm_props *props);
 
+dbus_bool_t ba_dbus_rfcomm_open_start(
+		struct ba_dbus_ctx *ctx,
+		const char *rfcomm_path,
+		DBusPendingCall **pending,
+		DBusError *error);
+
+dbus_bool_t ba_dbus_rfcomm_open_finish(
+		DBusPendingCall *pending,
+		int *fd_rfcomm,
+		DBusError *error);
+
 dbus_bool_t ba_dbus_rfcomm_open(
 		struct ba_dbus_ctx *ctx,
 		const char *rfcomm_path,
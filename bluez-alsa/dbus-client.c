@@ -7,10 +7,12 @@
 #include "dbus-client.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <time.h>
 
 #include "defs.h"
 
@@ -36,6 +38,47 @@ static void ba_dbus_watch_toggled(DBusWatch *watch, void *data) {
 	(void)data;
 }
 
+/* Deadline for the D-Bus calls made by the current thread. */
+static _Thread_local bool ba_dbus_deadline_enabled = false;
+static _Thread_local struct timespec ba_dbus_deadline;
+
+/**
+ * Set a deadline for all subsequent D-Bus method calls made by the calling
+ * thread, so that a sequence of calls completes (or fails) within the given
+ * time in milliseconds. A negative timeout clears the deadline. */
+void ba_dbus_deadline_set(
+		int timeout) {
+
+	if ((ba_dbus_deadline_enabled = timeout >= 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &ba_dbus_deadline);
+		ba_dbus_deadline.tv_sec += timeout / 1000;
+		ba_dbus_deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (ba_dbus_deadline.tv_nsec >= 1000000000) {
+			ba_dbus_deadline.tv_sec++;
+			ba_dbus_deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+}
+
+/**
+ * Get the timeout for a D-Bus method call. This is the time remaining until
+ * the deadline of the calling thread, or the D-Bus default if no deadline is
+ * set. Once the deadline has passed, calls are given the shortest possible
+ * timeout, so they fail immediately. */
+int ba_dbus_timeout(void) {
+
+	if (!ba_dbus_deadline_enabled)
+		return DBUS_TIMEOUT_USE_DEFAULT;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long remaining = (ba_dbus_deadline.tv_sec - now.tv_sec) * 1000 +
+		(ba_dbus_deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+	return remaining > 0 ? remaining : 1;
+}
+
 dbus_bool_t ba_dbus_connection_ctx_init(
 		struct ba_dbus_ctx *ctx,
 		const char *ba_service_name,
@@ -211,21 +254,80 @@ dbus_bool_t ba_dbus_connection_poll_dispatch(
 	return rv;
 }
 
-dbus_bool_t ba_dbus_props_get_all(
+/**
+ * Send a method call without waiting for the reply. The reply has to be
+ * collected with ba_dbus_call_finish(), which allows several calls to be
+ * in flight at the same time. */
+dbus_bool_t ba_dbus_call_start(
+		struct ba_dbus_ctx *ctx,
+		DBusMessage *msg,
+		DBusPendingCall **pending,
+		DBusError *error) {
+
+	if (!dbus_connection_send_with_reply(ctx->conn, msg, pending, ba_dbus_timeout())) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
+		return FALSE;
+	}
+
+	if (*pending == NULL) {
+		dbus_set_error_const(error, DBUS_ERROR_DISCONNECTED, "Connection is closed");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Wait for the reply of a method call sent with ba_dbus_call_start(). The
+ * pending call is released. Returns the reply message, or NULL if the call
+ * failed, in which case the error is set. */
+DBusMessage *ba_dbus_call_finish(
+		DBusPendingCall *pending,
+		DBusError *error) {
+
+	dbus_pending_call_block(pending);
+	DBusMessage *rep = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+
+	if (rep == NULL) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_REPLY, "No reply received");
+		return NULL;
+	}
+
+	if (dbus_set_error_from_message(error, rep)) {
+		dbus_message_unref(rep);
+		return NULL;
+	}
+
+	return rep;
+}
+
+/**
+ * Call a method and wait for the reply. */
+DBusMessage *ba_dbus_call(
+		struct ba_dbus_ctx *ctx,
+		DBusMessage *msg,
+		DBusError *error) {
+	DBusPendingCall *pending;
+	if (!ba_dbus_call_start(ctx, msg, &pending, error))
+		return NULL;
+	return ba_dbus_call_finish(pending, error);
+}
+
+dbus_bool_t ba_dbus_props_get_all_start(
 		struct ba_dbus_ctx *ctx,
 		const char *path,
 		const char *interface,
-		DBusError *error,
-		dbus_bool_t (*cb)(const char *key, DBusMessageIter *val, void *data, DBusError *err),
-		void *userdata) {
+		DBusPendingCall **pending,
+		DBusError *error) {
 
-	DBusMessage *msg = NULL, *rep = NULL;
+	DBusMessage *msg;
 	dbus_bool_t rv = FALSE;
 
 	if ((msg = dbus_message_new_method_call(ctx->ba_service, path,
 					DBUS_INTERFACE_PROPERTIES, "GetAll")) == NULL) {
 		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
-		goto fail;
+		return FALSE;
 	}
 
 	DBusMessageIter iter;
@@ -235,10 +337,26 @@ dbus_bool_t ba_dbus_props_get_all(
 		goto fail;
 	}
 
-	if ((rep = dbus_connection_send_with_reply_and_block(ctx->conn,
-					msg, DBUS_TIMEOUT_USE_DEFAULT, error)) == NULL)
-		goto fail;
+	rv = ba_dbus_call_start(ctx, msg, pending, error);
+
+fail:
+	dbus_message_unref(msg);
+	return rv;
+}
+
+dbus_bool_t ba_dbus_props_get_all_finish(
+		DBusPendingCall *pending,
+		DBusError *error,
+		dbus_bool_t (*cb)(const char *key, DBusMessageIter *val, void *data, DBusError *err),
+		void *userdata) {
+
+	DBusMessage *rep;
+	dbus_bool_t rv = FALSE;
+
+	if ((rep = ba_dbus_call_finish(pending, error)) == NULL)
+		return FALSE;
 
+	DBusMessageIter iter;
 	if (!dbus_message_iter_init(rep, &iter)) {
 		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE, "Empty response message");
 		goto fail;
@@ -250,96 +368,138 @@ dbus_bool_t ba_dbus_props_get_all(
 	rv = TRUE;
 
 fail:
-	if (rep != NULL)
-		dbus_message_unref(rep);
-	if (msg != NULL)
-		dbus_message_unref(msg);
+	dbus_message_unref(rep);
 	return rv;
 }
 
-/**
- * Callback function for manager object properties parser. */
-static dbus_bool_t bluealsa_dbus_message_iter_get_manager_props_cb(const char *key,
-		DBusMessageIter *value, void *userdata, DBusError *error) {
-	struct ba_service_props *props = (struct ba_service_props *)userdata;
-
-	char type;
-	if ((type = dbus_message_iter_get_arg_type(value)) != DBUS_TYPE_VARIANT) {
-		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-				"Incorrect property value type: %c != %c", type, DBUS_TYPE_VARIANT);
+dbus_bool_t ba_dbus_props_get_all(
+		struct ba_dbus_ctx *ctx,
+		const char *path,
+		const char *interface,
+		DBusError *error,
+		dbus_bool_t (*cb)(const char *key, DBusMessageIter *val, void *data, DBusError *err),
+		void *userdata) {
+	DBusPendingCall *pending;
+	if (!ba_dbus_props_get_all_start(ctx, path, interface, &pending, error))
 		return FALSE;
-	}
+	return ba_dbus_props_get_all_finish(pending, error, cb, userdata);
+}
 
-	DBusMessageIter variant;
-	dbus_message_iter_recurse(value, &variant);
-	type = dbus_message_iter_get_arg_type(&variant);
+static dbus_bool_t ba_dbus_manager_set_version(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_service_props *props = userdata;
+	(void)error;
 
-	char type_expected;
+	const char *tmp;
+	dbus_message_iter_get_basic(variant, &tmp);
+	strncpy(props->version, tmp, sizeof(props->version) - 1);
 
-	if (strcmp(key, "Version") == 0) {
+	return TRUE;
+}
 
-		if (type != (type_expected = DBUS_TYPE_STRING))
-			goto fail;
+static dbus_bool_t ba_dbus_manager_set_adapters(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_service_props *props = userdata;
 
-		const char *tmp;
-		dbus_message_iter_get_basic(&variant, &tmp);
-		strncpy(props->version, tmp, sizeof(props->version) - 1);
+	const char *tmp[ARRAYSIZE(props->adapters)];
+	size_t length = ARRAYSIZE(tmp);
+	if (!dbus_message_iter_array_get_strings(variant, error, tmp, &length))
+		return FALSE;
 
-	}
-	else if (strcmp(key, "Adapters") == 0) {
+	props->adapters_len = MIN(length, ARRAYSIZE(tmp));
+	for (size_t i = 0; i < props->adapters_len; i++)
+		strncpy(props->adapters[i], tmp[i], sizeof(props->adapters[i]) - 1);
 
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+	return TRUE;
+}
 
-		const char *tmp[ARRAYSIZE(props->adapters)];
-		size_t length = ARRAYSIZE(tmp);
-		if (!dbus_message_iter_array_get_strings(&variant, error, tmp, &length))
-			return FALSE;
+static dbus_bool_t ba_dbus_manager_set_profiles(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_service_props *props = userdata;
 
-		props->adapters_len = MIN(length, ARRAYSIZE(tmp));
-		for (size_t i = 0; i < length; i++)
-			strncpy(props->adapters[i], tmp[i], sizeof(props->adapters[i]) - 1);
+	const char *tmp[32];
+	size_t length = ARRAYSIZE(tmp);
+	if (!dbus_message_iter_array_get_strings(variant, error, tmp, &length))
+		return FALSE;
 
-	}
-	else if (strcmp(key, "Profiles") == 0) {
+	length = MIN(length, ARRAYSIZE(tmp));
+	props->profiles = malloc(length * sizeof(*props->profiles));
+	props->profiles_len = length;
+	for (size_t i = 0; i < length; i++)
+		props->profiles[i] = strdup(tmp[i]);
 
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+	return TRUE;
+}
 
-		const char *tmp[32];
-		size_t length = ARRAYSIZE(tmp);
-		if (!dbus_message_iter_array_get_strings(&variant, error, tmp, &length))
-			return FALSE;
+static dbus_bool_t ba_dbus_manager_set_codecs(DBusMessageIter *variant,
+		void *userdata, DBusError *error) {
+	struct ba_service_props *props = userdata;
 
-		props->profiles = malloc(length * sizeof(*props->profiles));
-		props->profiles_len = MIN(length, ARRAYSIZE(tmp));
-		for (size_t i = 0; i < length; i++)
-			props->profiles[i] = strdup(tmp[i]);
+	const char *tmp[64];
+	size_t length = ARRAYSIZE(tmp);
+	if (!dbus_message_iter_array_get_strings(variant, error, tmp, &length))
+		return FALSE;
 
-	}
-	else if (strcmp(key, "Codecs") == 0) {
+	length = MIN(length, ARRAYSIZE(tmp));
+	props->codecs = malloc(length * sizeof(*props->codecs));
+	props->codecs_len = length;
+	for (size_t i = 0; i < length; i++)
+		props->codecs[i] = strdup(tmp[i]);
 
-		if (type != (type_expected = DBUS_TYPE_ARRAY))
-			goto fail;
+	return TRUE;
+}
 
-		const char *tmp[64];
-		size_t length = ARRAYSIZE(tmp);
-		if (!dbus_message_iter_array_get_strings(&variant, error, tmp, &length))
-			return FALSE;
+enum {
+	BA_DBUS_MANAGER_PROP_VERSION,
+	BA_DBUS_MANAGER_PROP_ADAPTERS,
+	BA_DBUS_MANAGER_PROP_PROFILES,
+	BA_DBUS_MANAGER_PROP_CODECS,
+};
 
-		props->codecs = malloc(length * sizeof(*props->codecs));
-		props->codecs_len = MIN(length, ARRAYSIZE(tmp));
-		for (size_t i = 0; i < length; i++)
-			props->codecs[i] = strdup(tmp[i]);
+/**
+ * Manager object properties. */
+static const struct ba_dbus_prop ba_dbus_manager_props[] = {
+	[BA_DBUS_MANAGER_PROP_VERSION] =
+		BA_DBUS_PROP("Version", DBUS_TYPE_STRING, ba_dbus_manager_set_version),
+	[BA_DBUS_MANAGER_PROP_ADAPTERS] =
+		BA_DBUS_PROP("Adapters", DBUS_TYPE_ARRAY, ba_dbus_manager_set_adapters),
+	[BA_DBUS_MANAGER_PROP_PROFILES] =
+		BA_DBUS_PROP("Profiles", DBUS_TYPE_ARRAY, ba_dbus_manager_set_profiles),
+	[BA_DBUS_MANAGER_PROP_CODECS] =
+		BA_DBUS_PROP("Codecs", DBUS_TYPE_ARRAY, ba_dbus_manager_set_codecs),
+};
 
-	}
+/**
+ * Manager object adapters property, for parsers which need nothing else. */
+const struct ba_dbus_prop ba_dbus_manager_prop_adapters =
+	BA_DBUS_PROP("Adapters", DBUS_TYPE_ARRAY, ba_dbus_manager_set_adapters);
 
-	return TRUE;
+/**
+ * Select the manager property candidate for the given key. */
+static const struct ba_dbus_prop *ba_dbus_manager_prop_find(const char *key) {
+	switch (strlen(key)) {
+	case 6:
+		return &ba_dbus_manager_props[BA_DBUS_MANAGER_PROP_CODECS];
+	case 7:
+		return &ba_dbus_manager_props[BA_DBUS_MANAGER_PROP_VERSION];
+	case 8:
+		switch (key[0]) {
+		case 'A':
+			return &ba_dbus_manager_props[BA_DBUS_MANAGER_PROP_ADAPTERS];
+		case 'P':
+			return &ba_dbus_manager_props[BA_DBUS_MANAGER_PROP_PROFILES];
+		}
+		break;
+	}
+	return NULL;
+}
 
-fail:
-	dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
-			"Incorrect variant for '%s': %c != %c", key, type, type_expected);
-	return FALSE;
+/**
+ * Callback function for manager object properties parser. */
+static dbus_bool_t bluealsa_dbus_message_iter_get_manager_props_cb(const char *key,
+		DBusMessageIter *value, void *userdata, DBusError *error) {
+	return dbus_message_iter_dict_props(key, value,
+			ba_dbus_manager_prop_find(key), userdata, error);
 }
 
 /**
@@ -461,6 +621,42 @@ fail:
 	return FALSE;
 }
 
+/**
+ * Decode a single property with the given property table entry.
+ *
+ * The entry is the candidate selected by the table's lookup function, which
+ * switches on the key length and its first character, so the key is compared
+ * in full with at most one entry. If there is no candidate, or the candidate
+ * does not match, the property is not known to us and it is ignored. */
+dbus_bool_t dbus_message_iter_dict_props(
+		const char *key,
+		DBusMessageIter *value,
+		const struct ba_dbus_prop *prop,
+		void *userdata,
+		DBusError *error) {
+
+	if (prop == NULL || strcmp(prop->key, key) != 0)
+		return TRUE;
+
+	char type;
+	if ((type = dbus_message_iter_get_arg_type(value)) != DBUS_TYPE_VARIANT) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
+				"Incorrect property value type: %c != %c", type, DBUS_TYPE_VARIANT);
+		return FALSE;
+	}
+
+	DBusMessageIter variant;
+	dbus_message_iter_recurse(value, &variant);
+
+	if ((type = dbus_message_iter_get_arg_type(&variant)) != prop->type) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_SIGNATURE,
+				"Incorrect variant for '%s': %c != %c", key, type, prop->type);
+		return FALSE;
+	}
+
+	return prop->set(&variant, userdata, error);
+}
+
 /**
  * Append key-value pair with basic type value to the D-Bus message. */
 dbus_bool_t dbus_message_iter_dict_append_basic(
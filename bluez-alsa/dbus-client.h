@@ -43,6 +43,11 @@ struct ba_dbus_ctx {
 	char ba_service[32];
 };
 
+void ba_dbus_deadline_set(
+		int timeout);
+
+int ba_dbus_timeout(void);
+
 dbus_bool_t ba_dbus_connection_ctx_init(
 		struct ba_dbus_ctx *ctx,
 		const char *ba_service_name,
@@ -75,6 +80,34 @@ dbus_bool_t ba_dbus_connection_poll_dispatch(
 		struct pollfd *fds,
 		nfds_t nfds);
 
+dbus_bool_t ba_dbus_call_start(
+		struct ba_dbus_ctx *ctx,
+		DBusMessage *msg,
+		DBusPendingCall **pending,
+		DBusError *error);
+
+DBusMessage *ba_dbus_call_finish(
+		DBusPendingCall *pending,
+		DBusError *error);
+
+DBusMessage *ba_dbus_call(
+		struct ba_dbus_ctx *ctx,
+		DBusMessage *msg,
+		DBusError *error);
+
+dbus_bool_t ba_dbus_props_get_all_start(
+		struct ba_dbus_ctx *ctx,
+		const char *path,
+		const char *interface,
+		DBusPendingCall **pending,
+		DBusError *error);
+
+dbus_bool_t ba_dbus_props_get_all_finish(
+		DBusPendingCall *pending,
+		DBusError *error,
+		dbus_bool_t (*cb)(const char *key, DBusMessageIter *val, void *data, DBusError *err),
+		void *userdata);
+
 dbus_bool_t ba_dbus_props_get_all(
 		struct ba_dbus_ctx *ctx,
 		const char *path,
@@ -119,6 +152,27 @@ dbus_bool_t dbus_message_iter_dict(
 		dbus_bool_t (*cb)(const char *key, DBusMessageIter *val, void *data, DBusError *err),
 		void *userdata);
 
+/**
+ * Property decoder table entry. */
+struct ba_dbus_prop {
+	const char *key;
+	/* expected variant type */
+	int type;
+	/* store the value of the variant */
+	dbus_bool_t (*set)(DBusMessageIter *variant, void *data, DBusError *err);
+};
+
+#define BA_DBUS_PROP(key, type, set) { key, type, set }
+
+extern const struct ba_dbus_prop ba_dbus_manager_prop_adapters;
+
+dbus_bool_t dbus_message_iter_dict_props(
+		const char *key,
+		DBusMessageIter *value,
+		const struct ba_dbus_prop *prop,
+		void *userdata,
+		DBusError *error);
+
 dbus_bool_t dbus_message_iter_dict_append_basic(
 		DBusMessageIter *iter,
 		const char *key,
@@ -0,0 +1,564 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-broker.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <grp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-broker.h"
+#include "hfpag-lock.h"
+#include "hfpag-rfcomm.h"
+#include "bluez-alsa/dbus-client-rfcomm.h"
+#include "bluez-alsa/dbus-client.h"
+#include "bluez-alsa/defs.h"
+
+/* Interval in milliseconds at which a busy session lock is tried again. */
+#define BROKER_LOCK_RETRY_INTERVAL 10
+
+/**
+ * A device for which the broker owns the RFCOMM socket and the call state.
+ * The RFCOMM socket is kept open for as long as the device is connected.
+ * While the device is in use, the broker also takes part in the locking of
+ * both backends, so that processes which do not use the broker see the call
+ * as active too. */
+struct broker_device {
+	struct hfpag_rfcomm rfcomm;
+	/* RFCOMM Open call in progress, and when it was made */
+	DBusPendingCall *rfcomm_open;
+	struct timespec rfcomm_open_time;
+	struct hfpag_lock locks[2];
+	/* number of clients using the device, or waiting for it */
+	unsigned int refcount;
+	/* we take part in the call session of both locks */
+	bool locked;
+	struct broker_device *next;
+};
+
+struct broker_client {
+	int fd;
+	struct broker_device *device;
+	/* the begin request has been answered */
+	bool active;
+};
+
+static struct ba_dbus_ctx dbus_ctx;
+/* group whose members may use the broker, besides our own user */
+static gid_t allowed_gid = (gid_t)-1;
+static struct broker_device *devices = NULL;
+static struct broker_client *clients = NULL;
+static size_t clients_len = 0;
+static volatile sig_atomic_t main_loop_on = 1;
+
+static void main_loop_stop(int sig) {
+	(void)sig;
+	main_loop_on = 0;
+}
+
+/**
+ * Get the Bluetooth address from the BlueALSA RFCOMM path of the device. */
+static int broker_rfcomm_path_addr(const char *rfcomm_path, bdaddr_t *addr) {
+	const char *dev;
+	unsigned int b[6];
+	if ((dev = strstr(rfcomm_path, "/dev_")) == NULL ||
+			sscanf(dev, "/dev_%2X_%2X_%2X_%2X_%2X_%2X",
+				&b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6)
+		return -1;
+	for (size_t i = 0; i < ARRAYSIZE(b); i++)
+		addr->b[i] = b[i];
+	return 0;
+}
+
+static struct broker_device *broker_device_get(const char *rfcomm_path) {
+
+	struct broker_device *device;
+	for (device = devices; device != NULL; device = device->next)
+		if (strcmp(device->rfcomm.path, rfcomm_path) == 0)
+			return device;
+
+	bdaddr_t addr;
+	if (broker_rfcomm_path_addr(rfcomm_path, &addr) == -1)
+		return NULL;
+
+	if ((device = calloc(1, sizeof(*device))) == NULL)
+		return NULL;
+
+	hfpag_rfcomm_init(&device->rfcomm, rfcomm_path);
+	hfpag_lock_init(&device->locks[0], HFPAG_SESSION_LOCK_FILE, &addr);
+	hfpag_lock_init(&device->locks[1], HFPAG_SESSION_LOCK_SOCKET, &addr);
+	device->next = devices;
+	devices = device;
+
+	return device;
+}
+
+static void broker_device_free(struct broker_device *device) {
+
+	struct broker_device **pdevice;
+	for (pdevice = &devices; *pdevice != NULL; pdevice = &(*pdevice)->next)
+		if (*pdevice == device) {
+			*pdevice = device->next;
+			break;
+		}
+
+	if (device->rfcomm_open != NULL) {
+		dbus_pending_call_cancel(device->rfcomm_open);
+		dbus_pending_call_unref(device->rfcomm_open);
+	}
+
+	hfpag_rfcomm_close(&device->rfcomm);
+	free(device);
+}
+
+/**
+ * Open the RFCOMM socket of the device without blocking the main loop.
+ * Returns 0 once the socket is open, -1 on error, or the time in milliseconds
+ * to wait for the reply of BlueALSA. */
+static int broker_device_open(struct broker_device *device) {
+
+	if (device->rfcomm.fd != -1)
+		return 0;
+
+	DBusError err = DBUS_ERROR_INIT;
+	if (device->rfcomm_open == NULL) {
+		if (!ba_dbus_rfcomm_open_start(&dbus_ctx, device->rfcomm.path,
+					&device->rfcomm_open, &err))
+			goto fail;
+		clock_gettime(CLOCK_MONOTONIC, &device->rfcomm_open_time);
+		return HFPAG_BROKER_TIMEOUT;
+	}
+
+	if (!dbus_pending_call_get_completed(device->rfcomm_open)) {
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed = (now.tv_sec - device->rfcomm_open_time.tv_sec) * 1000 +
+			(now.tv_nsec - device->rfcomm_open_time.tv_nsec) / 1000000;
+		if (elapsed < HFPAG_BROKER_TIMEOUT)
+			return HFPAG_BROKER_TIMEOUT - elapsed;
+
+		dbus_pending_call_cancel(device->rfcomm_open);
+		dbus_pending_call_unref(device->rfcomm_open);
+		device->rfcomm_open = NULL;
+		dbus_set_error_const(&err, DBUS_ERROR_TIMEOUT, "No reply");
+		goto fail;
+	}
+
+	DBusPendingCall *pending = device->rfcomm_open;
+	device->rfcomm_open = NULL;
+	if (!ba_dbus_rfcomm_open_finish(pending, &device->rfcomm.fd, &err)) {
+		device->rfcomm.fd = -1;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Couldn't open RFCOMM: %s: %s\n", device->rfcomm.path, err.message);
+	dbus_error_free(&err);
+	return -1;
+}
+
+/**
+ * Take our part in the call, starting the call if no other process is using
+ * the device. Either all the locks are joined or none, and if any of them is
+ * busy, -1 is returned with errno set to EAGAIN, so that the main loop can
+ * serve the other clients and try again later. */
+static int broker_device_lock(struct broker_device *device) {
+
+	bool first = true;
+	size_t i;
+	for (i = 0; i < ARRAYSIZE(device->locks); i++) {
+		bool alone;
+		if (hfpag_lock_join(&device->locks[i], &alone, 0) == -1)
+			break;
+		first = first && alone;
+	}
+
+	int err = errno;
+	int ret = -1;
+	if (i == ARRAYSIZE(device->locks) &&
+			(ret = first ? hfpag_rfcomm_transfer_call(&device->rfcomm, &dbus_ctx) : 0) == -1)
+		err = EIO;
+
+	while (i-- > 0)
+		if (ret == 0)
+			hfpag_lock_release(&device->locks[i]);
+		else
+			hfpag_lock_cancel(&device->locks[i]);
+
+	errno = err;
+	return ret;
+}
+
+/**
+ * Give up our part in the call, terminating the call if no other process is
+ * using the device. The locks are always taken in the same order, so that
+ * the broker never deadlocks with itself. If any of them is busy, we stay in
+ * the call, and -1 is returned with errno set to EAGAIN. */
+static int broker_device_unlock(struct broker_device *device, int timeout) {
+
+	bool last = true;
+	bool held[ARRAYSIZE(device->locks)] = { false };
+	for (size_t i = 0; i < ARRAYSIZE(device->locks); i++) {
+		bool alone;
+		if ((held[i] = hfpag_lock_leave(&device->locks[i], &alone, timeout) == 0))
+			last = last && alone;
+		else if (errno == EAGAIN && timeout == 0) {
+			while (i-- > 0)
+				if (held[i])
+					hfpag_lock_cancel(&device->locks[i]);
+			errno = EAGAIN;
+			return -1;
+		}
+		else
+			last = false;
+	}
+
+	/* There is no call to terminate if the connection has been lost. */
+	if (last && device->rfcomm.fd != -1)
+		hfpag_rfcomm_terminate_call(&device->rfcomm, &dbus_ctx);
+
+	for (size_t i = ARRAYSIZE(device->locks); i > 0; i--)
+		if (held[i - 1])
+			hfpag_lock_release(&device->locks[i - 1]);
+
+	return 0;
+}
+
+/**
+ * Answer the clients waiting for the device. */
+static void broker_device_reply(struct broker_device *device, bool ok) {
+	for (size_t i = 0; i < clients_len; i++) {
+		struct broker_client *client = &clients[i];
+		if (client->device != device || client->active)
+			continue;
+		send(client->fd, ok ? HFPAG_BROKER_OK : HFPAG_BROKER_ERROR,
+				strlen(ok ? HFPAG_BROKER_OK : HFPAG_BROKER_ERROR),
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+		if ((client->active = ok))
+			continue;
+		client->device = NULL;
+		device->refcount--;
+	}
+}
+
+/**
+ * Bring the call state of the device in line with its clients, without
+ * blocking. Returns the time in milliseconds after which this should be done
+ * again, or -1 if there is nothing to wait for. */
+static int broker_device_update(struct broker_device *device) {
+
+	int ret;
+
+	if (device->refcount > 0 && !device->locked) {
+		if ((ret = broker_device_open(device)) > 0)
+			return ret;
+		if (ret == 0 && (ret = broker_device_lock(device)) == -1 && errno == EAGAIN)
+			return BROKER_LOCK_RETRY_INTERVAL;
+		device->locked = ret == 0;
+		broker_device_reply(device, device->locked);
+	}
+	else if (device->refcount > 0)
+		broker_device_reply(device, true);
+	else if (device->locked) {
+		if (broker_device_unlock(device, 0) == -1)
+			return BROKER_LOCK_RETRY_INTERVAL;
+		device->locked = false;
+	}
+	else if (device->rfcomm_open != NULL &&
+			(ret = broker_device_open(device)) > 0)
+		/* Nobody waits for the socket any more, but we keep it. */
+		return ret;
+
+	return -1;
+}
+
+/**
+ * Update all devices, and forget those which are neither used nor connected.
+ * Returns the poll timeout for the main loop. */
+static int broker_devices_update(void) {
+
+	int timeout = -1;
+	struct broker_device *device, *next;
+	for (device = devices; device != NULL; device = next) {
+		next = device->next;
+
+		int ret;
+		if ((ret = broker_device_update(device)) != -1)
+			timeout = timeout == -1 ? ret : MIN(timeout, ret);
+
+		if (device->refcount == 0 && !device->locked &&
+				device->rfcomm.fd == -1 && device->rfcomm_open == NULL)
+			broker_device_free(device);
+
+	}
+
+	return timeout;
+}
+
+static void broker_client_add(int fd) {
+
+	struct broker_client *tmp = clients;
+	if ((tmp = realloc(tmp, (clients_len + 1) * sizeof(*tmp))) == NULL) {
+		close(fd);
+		return;
+	}
+
+	clients = tmp;
+	clients[clients_len].fd = fd;
+	clients[clients_len].device = NULL;
+	clients[clients_len].active = false;
+	clients_len++;
+
+}
+
+/**
+ * Remove the client. Its part in the call is given up by the next update of
+ * the device. */
+static void broker_client_remove(size_t i) {
+	if (clients[i].device != NULL)
+		clients[i].device->refcount--;
+	close(clients[i].fd);
+	clients[i] = clients[--clients_len];
+}
+
+static void broker_client_reply(struct broker_client *client, const char *reply) {
+	send(client->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+ * Process a client request. Returns false if the client should be dropped.
+ * A begin request is answered once the call is active, which may take a few
+ * iterations of the main loop. */
+static bool broker_client_request(struct broker_client *client) {
+
+	char request[256];
+	ssize_t len;
+	if ((len = recv(client->fd, request, sizeof(request) - 1, 0)) <= 0)
+		return false;
+	request[len] = '\0';
+
+	const size_t begin_len = sizeof(HFPAG_BROKER_BEGIN) - 1;
+	if (strncmp(request, HFPAG_BROKER_BEGIN, begin_len) != 0 ||
+			client->device != NULL) {
+		broker_client_reply(client, HFPAG_BROKER_ERROR);
+		return true;
+	}
+
+	const char *rfcomm_path = &request[begin_len];
+	if (strncmp(rfcomm_path, "/org/bluealsa/", 14) != 0 ||
+			strlen(rfcomm_path) >= sizeof(((struct hfpag_rfcomm *)0)->path)) {
+		broker_client_reply(client, HFPAG_BROKER_ERROR);
+		return true;
+	}
+
+	struct broker_device *device;
+	if ((device = broker_device_get(rfcomm_path)) == NULL) {
+		broker_client_reply(client, HFPAG_BROKER_ERROR);
+		return true;
+	}
+
+	device->refcount++;
+	client->device = device;
+	client->active = false;
+	return true;
+}
+
+static int broker_listen(const char *service) {
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int len = snprintf(&addr.sun_path[1], sizeof(addr.sun_path) - 1,
+			HFPAG_BROKER_SOCKET "%s", service);
+	socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+	int fd;
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) == -1 ||
+			listen(fd, 16) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Only our own user, root and the members of the allowed group may use the
+ * broker, since a client can start and end calls on any device. */
+static bool broker_client_allowed(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	return cred.uid == getuid() || cred.uid == 0 ||
+		(allowed_gid != (gid_t)-1 && cred.gid == allowed_gid);
+}
+
+static void usage(const char *progname) {
+	printf("Usage:\n"
+			"  %s [OPTION]...\n"
+			"\nOptions:\n"
+			"  -h, --help\t\tprint this help and exit\n"
+			"  -B, --dbus=NAME\tBlueALSA service name suffix\n"
+			"  -g, --group=NAME\tallow the members of this group\n",
+			progname);
+}
+
+int main(int argc, char *argv[]) {
+
+	const char *opts = "hB:g:";
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "dbus", required_argument, NULL, 'B' },
+		{ "group", required_argument, NULL, 'g' },
+		{ 0, 0, 0, 0 },
+	};
+
+	char service[32] = BLUEALSA_SERVICE;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'B':
+			snprintf(service, sizeof(service), BLUEALSA_SERVICE ".%s", optarg);
+			break;
+		case 'g': {
+			struct group *gr;
+			if ((gr = getgrnam(optarg)) == NULL) {
+				fprintf(stderr, "Unknown group: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			allowed_gid = gr->gr_gid;
+			break;
+		}
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	DBusError err = DBUS_ERROR_INIT;
+	if (!ba_dbus_connection_ctx_init(&dbus_ctx, service, &err)) {
+		fprintf(stderr, "Couldn't initialize D-Bus context: %s\n", err.message);
+		return EXIT_FAILURE;
+	}
+
+	int listen_fd;
+	if ((listen_fd = broker_listen(service)) == -1) {
+		fprintf(stderr, "Couldn't create broker socket: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sigact = { .sa_handler = main_loop_stop };
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+
+	while (main_loop_on) {
+
+		const int timeout = broker_devices_update();
+
+		size_t devices_len = 0;
+		for (struct broker_device *d = devices; d != NULL; d = d->next)
+			devices_len++;
+
+		struct pollfd pfds[1 + 8 + clients_len + devices_len];
+		struct broker_device *pdevices[devices_len + 1];
+		nfds_t nfds = 0;
+
+		pfds[nfds++] = (struct pollfd){ listen_fd, POLLIN, 0 };
+
+		/* The replies of the RFCOMM Open calls arrive on this connection. */
+		nfds_t dbus_nfds = 8;
+		if (!ba_dbus_connection_poll_fds(&dbus_ctx, &pfds[nfds], &dbus_nfds))
+			dbus_nfds = 0;
+		nfds += dbus_nfds;
+
+		const size_t clients_offset = nfds;
+		for (size_t i = 0; i < clients_len; i++)
+			pfds[nfds++] = (struct pollfd){ clients[i].fd, POLLIN, 0 };
+		const size_t devices_offset = nfds;
+		for (struct broker_device *d = devices; d != NULL; d = d->next) {
+			pdevices[nfds - devices_offset] = d;
+			pfds[nfds++] = (struct pollfd){ d->rfcomm.fd, POLLIN, 0 };
+		}
+
+		if (poll(pfds, nfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Poll error: %s\n", strerror(errno));
+			break;
+		}
+
+		ba_dbus_connection_poll_dispatch(&dbus_ctx, &pfds[1], dbus_nfds);
+		while (dbus_connection_dispatch(dbus_ctx.conn) == DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+
+		for (size_t i = 0; i < devices_len; i++) {
+			const short revents = pfds[devices_offset + i].revents;
+			struct broker_device *device = pdevices[i];
+			if (revents & (POLLERR | POLLHUP) ||
+					(revents & POLLIN && hfpag_rfcomm_dispatch(&device->rfcomm) == -1))
+				/* The RFCOMM connection is gone. If the device is not in use,
+				 * it is forgotten by the next update. Otherwise the socket is
+				 * re-opened with the next call. */
+				hfpag_rfcomm_close(&device->rfcomm);
+		}
+
+		/* Iterate backwards, so that removing a client does not affect the
+		 * ones yet to be processed. */
+		for (size_t i = clients_len; i > 0; i--) {
+			const short revents = pfds[clients_offset + i - 1].revents;
+			if (revents & POLLIN && broker_client_request(&clients[i - 1]))
+				continue;
+			if (revents)
+				broker_client_remove(i - 1);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd;
+			if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+				if (broker_client_allowed(fd))
+					broker_client_add(fd);
+				else
+					close(fd);
+			}
+		}
+
+	}
+
+	/* Do not leave the remote devices with an active call. At this point
+	 * we can afford to wait for the locks. */
+	while (clients_len > 0)
+		broker_client_remove(clients_len - 1);
+	while (devices != NULL) {
+		if (devices->locked)
+			broker_device_unlock(devices, HFPAG_BROKER_TIMEOUT);
+		broker_device_free(devices);
+	}
+
+	close(listen_fd);
+	ba_dbus_connection_ctx_free(&dbus_ctx);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,28 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-broker.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_BROKER_H_
+#define HFPAG_BROKER_H_
+
+/**
+ * The broker listens on a SOCK_SEQPACKET socket in the abstract namespace,
+ * whose name is this prefix followed by the BlueALSA service name.
+ *
+ * A client registers its use of a device by sending a begin request with the
+ * BlueALSA RFCOMM path of the device. The broker replies once the call is
+ * active. The client then keeps the connection open for as long as it uses
+ * the device; closing the connection ends its use. */
+#define HFPAG_BROKER_SOCKET "bluealsa-hfpag-broker:"
+
+#define HFPAG_BROKER_BEGIN "BEGIN "
+#define HFPAG_BROKER_OK    "OK"
+#define HFPAG_BROKER_ERROR "ERROR"
+
+/* Maximum time in milliseconds a client waits for the broker to reply. */
+#define HFPAG_BROKER_TIMEOUT 5000
+
+#endif
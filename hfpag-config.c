@@ -0,0 +1,159 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-config.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <alsa/conf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hfpag-config.h"
+
+int hfpag_str2ba(const char *str, bdaddr_t *ba) {
+
+	unsigned int x[6];
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+				&x[5], &x[4], &x[3], &x[2], &x[1], &x[0]) != 6)
+		return -1;
+
+	size_t i;
+	for (i = 0; i < 6; i++)
+		ba->b[i] = x[i];
+
+	return 0;
+}
+
+void hfpag_config_init(struct hfpag_config *config) {
+	config->device = "00:00:00:00:00:00";
+	config->service = "org.bluealsa";
+	config->linger = 0;
+	config->eager = false;
+	config->ready = 0;
+	config->lock = HFPAG_SESSION_LOCK_FILE;
+	config->async = false;
+	config->timeout = 0;
+}
+
+/**
+ * Parse a single call session option.
+ *
+ * Returns 1 if the option was parsed, 0 if it is not a call session option,
+ * or a negative error code if the value is invalid. */
+int hfpag_config_parse(struct hfpag_config *config, snd_config_t *node, const char *id) {
+
+	if (strcmp(id, "device") == 0) {
+		if (snd_config_get_string(node, &config->device) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		return 1;
+	}
+	else if (strcmp(id, "service") == 0) {
+		if (snd_config_get_string(node, &config->service) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		return 1;
+	}
+	else if (strcmp(id, "linger") == 0) {
+		if (snd_config_get_integer(node, &config->linger) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		if (config->linger < 0 || config->linger > 60000) {
+			SNDERR("Invalid linger time: %ld", config->linger);
+			return -EINVAL;
+		}
+		return 1;
+	}
+	else if (strcmp(id, "eager") == 0) {
+		int val;
+		if ((val = snd_config_get_bool(node)) < 0) {
+			SNDERR("Invalid value for %s", id);
+			return -EINVAL;
+		}
+		config->eager = val;
+		return 1;
+	}
+	else if (strcmp(id, "ready") == 0) {
+		if (snd_config_get_integer(node, &config->ready) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		if (config->ready < 0 || config->ready > 60000) {
+			SNDERR("Invalid ready timeout: %ld", config->ready);
+			return -EINVAL;
+		}
+		return 1;
+	}
+	else if (strcmp(id, "timeout") == 0) {
+		if (snd_config_get_integer(node, &config->timeout) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		if (config->timeout < 0 || config->timeout > 60000) {
+			SNDERR("Invalid timeout: %ld", config->timeout);
+			return -EINVAL;
+		}
+		return 1;
+	}
+	else if (strcmp(id, "async") == 0) {
+		int val;
+		if ((val = snd_config_get_bool(node)) < 0) {
+			SNDERR("Invalid value for %s", id);
+			return -EINVAL;
+		}
+		config->async = val;
+		return 1;
+	}
+	else if (strcmp(id, "lock") == 0) {
+		const char *val;
+		if (snd_config_get_string(node, &val) < 0) {
+			SNDERR("Invalid type for %s", id);
+			return -EINVAL;
+		}
+		if (strcmp(val, "file") == 0)
+			config->lock = HFPAG_SESSION_LOCK_FILE;
+		else if (strcmp(val, "socket") == 0)
+			config->lock = HFPAG_SESSION_LOCK_SOCKET;
+		else {
+			SNDERR("Invalid lock type: %s", val);
+			return -EINVAL;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Apply the environment overrides and validate the device address. */
+int hfpag_config_finish(struct hfpag_config *config, bdaddr_t *addr) {
+
+	/* The environment overrides the configuration, so that the open time
+	 * can be bounded for a single application. */
+	const char *env;
+	if ((env = getenv("BLUEALSA_HFPAG_TIMEOUT")) != NULL) {
+		char *end;
+		errno = 0;
+		long timeout = strtol(env, &end, 10);
+		if (errno != 0 || end == env || *end != '\0' ||
+				timeout < 0 || timeout > 60000) {
+			SNDERR("Invalid timeout: %s", env);
+			return -EINVAL;
+		}
+		config->timeout = timeout;
+	}
+
+	if (config->device == NULL || hfpag_str2ba(config->device, addr) != 0) {
+		SNDERR("Invalid BT device address: %s", config->device);
+		return -EINVAL;
+	}
+
+	return 0;
+}
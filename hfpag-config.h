@@ -0,0 +1,36 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-config.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_CONFIG_H_
+#define HFPAG_CONFIG_H_
+
+#include <alsa/asoundlib.h>
+#include <bluetooth/bluetooth.h>
+#include <stdbool.h>
+
+#include "hfpag-session.h"
+
+/**
+ * The call session options shared by the hooks and the ioplug PCMs. */
+struct hfpag_config {
+	const char *device;
+	const char *service;
+	long linger;
+	bool eager;
+	long ready;
+	enum hfpag_session_lock lock;
+	bool async;
+	long timeout;
+};
+
+void hfpag_config_init(struct hfpag_config *config);
+int hfpag_config_parse(struct hfpag_config *config, snd_config_t *node, const char *id);
+int hfpag_config_finish(struct hfpag_config *config, bdaddr_t *addr);
+
+int hfpag_str2ba(const char *str, bdaddr_t *ba);
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-convert.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+# define HFPAG_CONVERT_X86 1
+# include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+#include "hfpag-convert.h"
+
+/*
+ * All conversions are to or from S16 mono, the format of the SCO link.
+ *
+ * Down-mixing takes the mean of both channels, so that a signal present in
+ * both of them does not clip. Floating point samples are rounded to the
+ * nearest integer and saturated, S32 samples are truncated, like the ALSA
+ * linear conversion does. Up-mixing copies the sample to both channels.
+ *
+ * The SIMD kernels produce exactly the same output as the scalar ones, and
+ * leave the tail of the buffer which does not fill a whole vector to them.
+ */
+
+static inline int16_t hfpag_convert_float_s16(float sample) {
+	sample *= 32768.0f;
+	if (sample >= INT16_MAX)
+		return INT16_MAX;
+	if (sample <= INT16_MIN)
+		return INT16_MIN;
+	return lrintf(sample);
+}
+
+static void hfpag_convert_from_float1(void *dst, const void *src, size_t frames) {
+	const float *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = hfpag_convert_float_s16(in[i]);
+}
+
+static void hfpag_convert_from_float2(void *dst, const void *src, size_t frames) {
+	const float *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = hfpag_convert_float_s16((in[2 * i] + in[2 * i + 1]) * 0.5f);
+}
+
+static void hfpag_convert_from_s32_1(void *dst, const void *src, size_t frames) {
+	const int32_t *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = in[i] >> 16;
+}
+
+static void hfpag_convert_from_s32_2(void *dst, const void *src, size_t frames) {
+	const int32_t *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = ((in[2 * i] >> 1) + (in[2 * i + 1] >> 1)) >> 16;
+}
+
+static void hfpag_convert_from_s16_2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = (in[2 * i] + in[2 * i + 1]) >> 1;
+}
+
+static void hfpag_convert_to_float1(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	float *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = in[i] * (1.0f / 32768);
+}
+
+static void hfpag_convert_to_float2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	float *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[2 * i] = out[2 * i + 1] = in[i] * (1.0f / 32768);
+}
+
+static void hfpag_convert_to_s32_1(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int32_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[i] = in[i] * 65536;
+}
+
+static void hfpag_convert_to_s32_2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int32_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[2 * i] = out[2 * i + 1] = in[i] * 65536;
+}
+
+static void hfpag_convert_to_s16_2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int16_t *out = dst;
+	for (size_t i = 0; i < frames; i++)
+		out[2 * i] = out[2 * i + 1] = in[i];
+}
+
+#if HFPAG_CONVERT_X86
+
+static void hfpag_convert_from_float2_sse2(void *dst, const void *src, size_t frames) {
+	const float *in = src;
+	int16_t *out = dst;
+	const __m128 scale = _mm_set1_ps(0.5f * 32768.0f);
+	const __m128 max = _mm_set1_ps(INT16_MAX);
+	const __m128 min = _mm_set1_ps(INT16_MIN);
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const __m128 a = _mm_loadu_ps(in + 2 * i);
+		const __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+		const __m128 c = _mm_loadu_ps(in + 2 * i + 8);
+		const __m128 d = _mm_loadu_ps(in + 2 * i + 12);
+		__m128 lo = _mm_add_ps(_mm_shuffle_ps(a, b, 0x88), _mm_shuffle_ps(a, b, 0xDD));
+		__m128 hi = _mm_add_ps(_mm_shuffle_ps(c, d, 0x88), _mm_shuffle_ps(c, d, 0xDD));
+		lo = _mm_max_ps(_mm_min_ps(_mm_mul_ps(lo, scale), max), min);
+		hi = _mm_max_ps(_mm_min_ps(_mm_mul_ps(hi, scale), max), min);
+		_mm_storeu_si128((__m128i *)(out + i),
+				_mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+	}
+	hfpag_convert_from_float2(out + i, in + 2 * i, frames - i);
+}
+
+static void hfpag_convert_from_s32_2_sse2(void *dst, const void *src, size_t frames) {
+	const int32_t *in = src;
+	int16_t *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		__m128i mix[2];
+		for (size_t j = 0; j < 2; j++) {
+			const __m128 a = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(in + 2 * i + 8 * j)));
+			const __m128 b = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *)(in + 2 * i + 8 * j + 4)));
+			const __m128i l = _mm_castps_si128(_mm_shuffle_ps(a, b, 0x88));
+			const __m128i r = _mm_castps_si128(_mm_shuffle_ps(a, b, 0xDD));
+			mix[j] = _mm_srai_epi32(_mm_add_epi32(_mm_srai_epi32(l, 1), _mm_srai_epi32(r, 1)), 16);
+		}
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(mix[0], mix[1]));
+	}
+	hfpag_convert_from_s32_2(out + i, in + 2 * i, frames - i);
+}
+
+static void hfpag_convert_to_float2_sse2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	float *out = dst;
+	const __m128 scale = _mm_set1_ps(1.0f / 32768);
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+		const __m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), scale);
+		const __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), scale);
+		_mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(lo, lo));
+		_mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(lo, lo));
+		_mm_storeu_ps(out + 2 * i + 8, _mm_unpacklo_ps(hi, hi));
+		_mm_storeu_ps(out + 2 * i + 12, _mm_unpackhi_ps(hi, hi));
+	}
+	hfpag_convert_to_float2(out + 2 * i, in + i, frames - i);
+}
+
+static void hfpag_convert_to_s32_2_sse2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int32_t *out = dst;
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+		const __m128i lo = _mm_unpacklo_epi16(zero, s);
+		const __m128i hi = _mm_unpackhi_epi16(zero, s);
+		_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi32(lo, lo));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 4), _mm_unpackhi_epi32(lo, lo));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 8), _mm_unpacklo_epi32(hi, hi));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 12), _mm_unpackhi_epi32(hi, hi));
+	}
+	hfpag_convert_to_s32_2(out + 2 * i, in + i, frames - i);
+}
+
+/* The AVX2 shuffles and packs work within 128-bit lanes, so the down-mixed
+ * pairs of samples come out in the order 0, 4, 1, 5, 2, 6, 3, 7. */
+#define HFPAG_CONVERT_AVX2_ORDER _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)
+
+__attribute__ ((target("avx2")))
+static void hfpag_convert_from_float2_avx2(void *dst, const void *src, size_t frames) {
+	const float *in = src;
+	int16_t *out = dst;
+	const __m256 scale = _mm256_set1_ps(0.5f * 32768.0f);
+	const __m256 max = _mm256_set1_ps(INT16_MAX);
+	const __m256 min = _mm256_set1_ps(INT16_MIN);
+	size_t i;
+	for (i = 0; i + 16 <= frames; i += 16) {
+		const __m256 a = _mm256_loadu_ps(in + 2 * i);
+		const __m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+		const __m256 c = _mm256_loadu_ps(in + 2 * i + 16);
+		const __m256 d = _mm256_loadu_ps(in + 2 * i + 24);
+		__m256 lo = _mm256_add_ps(_mm256_shuffle_ps(a, b, 0x88), _mm256_shuffle_ps(a, b, 0xDD));
+		__m256 hi = _mm256_add_ps(_mm256_shuffle_ps(c, d, 0x88), _mm256_shuffle_ps(c, d, 0xDD));
+		lo = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(lo, scale), max), min);
+		hi = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(hi, scale), max), min);
+		const __m256i s = _mm256_packs_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+		_mm256_storeu_si256((__m256i *)(out + i),
+				_mm256_permutevar8x32_epi32(s, HFPAG_CONVERT_AVX2_ORDER));
+	}
+	hfpag_convert_from_float2(out + i, in + 2 * i, frames - i);
+}
+
+__attribute__ ((target("avx2")))
+static void hfpag_convert_from_s32_2_avx2(void *dst, const void *src, size_t frames) {
+	const int32_t *in = src;
+	int16_t *out = dst;
+	size_t i;
+	for (i = 0; i + 16 <= frames; i += 16) {
+		__m256i mix[2];
+		for (size_t j = 0; j < 2; j++) {
+			const __m256 a = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i *)(in + 2 * i + 16 * j)));
+			const __m256 b = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i *)(in + 2 * i + 16 * j + 8)));
+			const __m256i l = _mm256_castps_si256(_mm256_shuffle_ps(a, b, 0x88));
+			const __m256i r = _mm256_castps_si256(_mm256_shuffle_ps(a, b, 0xDD));
+			mix[j] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_srai_epi32(l, 1), _mm256_srai_epi32(r, 1)), 16);
+		}
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(
+					_mm256_packs_epi32(mix[0], mix[1]), HFPAG_CONVERT_AVX2_ORDER));
+	}
+	hfpag_convert_from_s32_2(out + i, in + 2 * i, frames - i);
+}
+
+__attribute__ ((target("avx2")))
+static void hfpag_convert_to_float2_avx2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	float *out = dst;
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768);
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+		const __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s)), scale);
+		const __m256 lo = _mm256_unpacklo_ps(f, f);
+		const __m256 hi = _mm256_unpackhi_ps(f, f);
+		_mm256_storeu_ps(out + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(out + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	hfpag_convert_to_float2(out + 2 * i, in + i, frames - i);
+}
+
+__attribute__ ((target("avx2")))
+static void hfpag_convert_to_s32_2_avx2(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int32_t *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const __m128i s = _mm_loadu_si128((const __m128i *)(in + i));
+		const __m256i v = _mm256_slli_epi32(_mm256_cvtepi16_epi32(s), 16);
+		const __m256i lo = _mm256_unpacklo_epi32(v, v);
+		const __m256i hi = _mm256_unpackhi_epi32(v, v);
+		_mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(out + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	hfpag_convert_to_s32_2(out + 2 * i, in + i, frames - i);
+}
+
+#endif
+
+#if defined(__aarch64__)
+
+static void hfpag_convert_from_float2_neon(void *dst, const void *src, size_t frames) {
+	const float *in = src;
+	int16_t *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const float32x4x2_t a = vld2q_f32(in + 2 * i);
+		const float32x4x2_t b = vld2q_f32(in + 2 * i + 8);
+		/* Both conversions saturate, which clips like the scalar code. */
+		const int32x4_t lo = vcvtnq_s32_f32(vmulq_n_f32(vaddq_f32(a.val[0], a.val[1]), 0.5f * 32768.0f));
+		const int32x4_t hi = vcvtnq_s32_f32(vmulq_n_f32(vaddq_f32(b.val[0], b.val[1]), 0.5f * 32768.0f));
+		vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+	}
+	hfpag_convert_from_float2(out + i, in + 2 * i, frames - i);
+}
+
+static void hfpag_convert_from_s32_2_neon(void *dst, const void *src, size_t frames) {
+	const int32_t *in = src;
+	int16_t *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int32x4x2_t a = vld2q_s32(in + 2 * i);
+		const int32x4x2_t b = vld2q_s32(in + 2 * i + 8);
+		const int32x4_t lo = vshrq_n_s32(vaddq_s32(vshrq_n_s32(a.val[0], 1), vshrq_n_s32(a.val[1], 1)), 16);
+		const int32x4_t hi = vshrq_n_s32(vaddq_s32(vshrq_n_s32(b.val[0], 1), vshrq_n_s32(b.val[1], 1)), 16);
+		vst1q_s16(out + i, vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+	}
+	hfpag_convert_from_s32_2(out + i, in + 2 * i, frames - i);
+}
+
+static void hfpag_convert_to_float2_neon(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	float *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int16x8_t s = vld1q_s16(in + i);
+		const float32x4_t lo = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), 1.0f / 32768);
+		const float32x4_t hi = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), 1.0f / 32768);
+		vst2q_f32(out + 2 * i, (float32x4x2_t){{ lo, lo }});
+		vst2q_f32(out + 2 * i + 8, (float32x4x2_t){{ hi, hi }});
+	}
+	hfpag_convert_to_float2(out + 2 * i, in + i, frames - i);
+}
+
+static void hfpag_convert_to_s32_2_neon(void *dst, const void *src, size_t frames) {
+	const int16_t *in = src;
+	int32_t *out = dst;
+	size_t i;
+	for (i = 0; i + 8 <= frames; i += 8) {
+		const int16x8_t s = vld1q_s16(in + i);
+		const int32x4_t lo = vshll_n_s16(vget_low_s16(s), 16);
+		const int32x4_t hi = vshll_n_s16(vget_high_s16(s), 16);
+		vst2q_s32(out + 2 * i, (int32x4x2_t){{ lo, lo }});
+		vst2q_s32(out + 2 * i + 8, (int32x4x2_t){{ hi, hi }});
+	}
+	hfpag_convert_to_s32_2(out + 2 * i, in + i, frames - i);
+}
+
+#endif
+
+/**
+ * Stereo conversions, which have SIMD kernels. */
+static struct {
+	hfpag_convert_t from_float2;
+	hfpag_convert_t from_s32_2;
+	hfpag_convert_t to_float2;
+	hfpag_convert_t to_s32_2;
+} hfpag_convert_kernels = {
+	.from_float2 = hfpag_convert_from_float2,
+	.from_s32_2 = hfpag_convert_from_s32_2,
+	.to_float2 = hfpag_convert_to_float2,
+	.to_s32_2 = hfpag_convert_to_s32_2,
+};
+
+static pthread_once_t hfpag_convert_kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Select the fastest kernels supported by the CPU. */
+static void hfpag_convert_kernels_init(void) {
+#if HFPAG_CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		hfpag_convert_kernels.from_float2 = hfpag_convert_from_float2_avx2;
+		hfpag_convert_kernels.from_s32_2 = hfpag_convert_from_s32_2_avx2;
+		hfpag_convert_kernels.to_float2 = hfpag_convert_to_float2_avx2;
+		hfpag_convert_kernels.to_s32_2 = hfpag_convert_to_s32_2_avx2;
+	}
+	else {
+		hfpag_convert_kernels.from_float2 = hfpag_convert_from_float2_sse2;
+		hfpag_convert_kernels.from_s32_2 = hfpag_convert_from_s32_2_sse2;
+		hfpag_convert_kernels.to_float2 = hfpag_convert_to_float2_sse2;
+		hfpag_convert_kernels.to_s32_2 = hfpag_convert_to_s32_2_sse2;
+	}
+#elif defined(__aarch64__)
+	hfpag_convert_kernels.from_float2 = hfpag_convert_from_float2_neon;
+	hfpag_convert_kernels.from_s32_2 = hfpag_convert_from_s32_2_neon;
+	hfpag_convert_kernels.to_float2 = hfpag_convert_to_float2_neon;
+	hfpag_convert_kernels.to_s32_2 = hfpag_convert_to_s32_2_neon;
+#endif
+}
+
+/**
+ * Get the function which converts frames of the given format to S16 mono.
+ * Returns NULL if the conversion is not supported, or not needed. */
+hfpag_convert_t hfpag_convert_from(snd_pcm_format_t format, unsigned int channels) {
+	pthread_once(&hfpag_convert_kernels_once, hfpag_convert_kernels_init);
+	switch (format) {
+	case SND_PCM_FORMAT_S16_LE:
+		return channels == 2 ? hfpag_convert_from_s16_2 : NULL;
+	case SND_PCM_FORMAT_S32_LE:
+		return channels == 1 ? hfpag_convert_from_s32_1 :
+			channels == 2 ? hfpag_convert_kernels.from_s32_2 : NULL;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		return channels == 1 ? hfpag_convert_from_float1 :
+			channels == 2 ? hfpag_convert_kernels.from_float2 : NULL;
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Get the function which converts S16 mono to frames of the given format.
+ * Returns NULL if the conversion is not supported, or not needed. */
+hfpag_convert_t hfpag_convert_to(snd_pcm_format_t format, unsigned int channels) {
+	pthread_once(&hfpag_convert_kernels_once, hfpag_convert_kernels_init);
+	switch (format) {
+	case SND_PCM_FORMAT_S16_LE:
+		return channels == 2 ? hfpag_convert_to_s16_2 : NULL;
+	case SND_PCM_FORMAT_S32_LE:
+		return channels == 1 ? hfpag_convert_to_s32_1 :
+			channels == 2 ? hfpag_convert_kernels.to_s32_2 : NULL;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		return channels == 1 ? hfpag_convert_to_float1 :
+			channels == 2 ? hfpag_convert_kernels.to_float2 : NULL;
+	default:
+		return NULL;
+	}
+}
@@ -0,0 +1,21 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-convert.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_CONVERT_H_
+#define HFPAG_CONVERT_H_
+
+#include <alsa/asoundlib.h>
+#include <stddef.h>
+
+/**
+ * Sample format and channel conversion function. */
+typedef void (*hfpag_convert_t)(void *dst, const void *src, size_t frames);
+
+hfpag_convert_t hfpag_convert_from(snd_pcm_format_t format, unsigned int channels);
+hfpag_convert_t hfpag_convert_to(snd_pcm_format_t format, unsigned int channels);
+
+#endif
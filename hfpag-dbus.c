@@ -0,0 +1,650 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-dbus.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-dbus.h"
+#include "bluez-alsa/defs.h"
+
+/**
+ * A process may open many hfpag PCMs (playback and capture, for several
+ * devices), so rather than each one setting up its own private bus
+ * connection we keep a single reference counted connection per BlueALSA
+ * service. */
+struct hfpag_dbus_conn {
+	/* must be first, we convert between the two with a cast */
+	struct ba_dbus_ctx ctx;
+	unsigned int refcount;
+	struct hfpag_dbus_conn *next;
+
+	/* serializes access to the PCM cache and signal dispatching */
+	pthread_mutex_t mutex;
+	/* signalled whenever the cache has been updated by a signal */
+	pthread_cond_t updated;
+	/* signal matches and filter have been registered */
+	bool signals;
+	/* drains the connection while signals are registered, so that the
+	 * incoming queue does not grow between lookups */
+	pthread_t dispatcher_tid;
+	int dispatcher_event_fd;
+	bool dispatcher_quit;
+	/* cached BlueALSA PCM objects */
+	struct ba_pcm *pcms;
+	size_t pcms_len;
+	/* the cache holds every PCM of the service */
+	bool pcms_complete;
+	/* index of the most recently connected HFP-AG PCM for each mode */
+	ssize_t last_source;
+	ssize_t last_sink;
+};
+
+static pthread_mutex_t hfpag_dbus_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hfpag_dbus_conn *hfpag_dbus_conns = NULL;
+
+static ssize_t hfpag_dbus_cache_find(struct hfpag_dbus_conn *conn, const char *pcm_path) {
+	for (size_t i = 0; i < conn->pcms_len; i++)
+		if (strcmp(conn->pcms[i].pcm_path, pcm_path) == 0)
+			return i;
+	return -1;
+}
+
+/**
+ * Re-calculate the most recently connected HFP-AG PCMs. This is required
+ * every time the cache content changes. */
+static void hfpag_dbus_cache_update_last(struct hfpag_dbus_conn *conn) {
+	uint32_t seq_source = 0;
+	uint32_t seq_sink = 0;
+
+	conn->last_source = -1;
+	conn->last_sink = -1;
+
+	for (size_t i = 0; i < conn->pcms_len; i++) {
+		const struct ba_pcm *pcm = &conn->pcms[i];
+		if (!(pcm->transport & BA_PCM_TRANSPORT_HFP_AG))
+			continue;
+		if (pcm->mode == BA_PCM_MODE_SOURCE && pcm->sequence >= seq_source) {
+			seq_source = pcm->sequence;
+			conn->last_source = i;
+		}
+		else if (pcm->mode == BA_PCM_MODE_SINK && pcm->sequence >= seq_sink) {
+			seq_sink = pcm->sequence;
+			conn->last_sink = i;
+		}
+	}
+
+}
+
+static bool hfpag_dbus_cache_add(struct hfpag_dbus_conn *conn, const struct ba_pcm *pcm) {
+
+	ssize_t i;
+	if ((i = hfpag_dbus_cache_find(conn, pcm->pcm_path)) == -1) {
+		struct ba_pcm *tmp = conn->pcms;
+		if ((tmp = realloc(tmp, (conn->pcms_len + 1) * sizeof(*tmp))) == NULL)
+			return false;
+		conn->pcms = tmp;
+		i = conn->pcms_len++;
+	}
+
+	memcpy(&conn->pcms[i], pcm, sizeof(*pcm));
+	hfpag_dbus_cache_update_last(conn);
+	return true;
+}
+
+static void hfpag_dbus_cache_remove(struct hfpag_dbus_conn *conn, const char *pcm_path) {
+	ssize_t i;
+	if ((i = hfpag_dbus_cache_find(conn, pcm_path)) == -1)
+		return;
+	conn->pcms[i] = conn->pcms[--conn->pcms_len];
+	hfpag_dbus_cache_update_last(conn);
+}
+
+static void hfpag_dbus_cache_clear(struct hfpag_dbus_conn *conn) {
+	free(conn->pcms);
+	conn->pcms = NULL;
+	conn->pcms_len = 0;
+	conn->pcms_complete = false;
+	conn->last_source = -1;
+	conn->last_sink = -1;
+}
+
+/**
+ * Replace the cache content with all PCMs currently provided by the service. */
+static dbus_bool_t hfpag_dbus_cache_fill(struct hfpag_dbus_conn *conn, DBusError *error) {
+
+	struct ba_pcm *pcms = NULL;
+	size_t length = 0;
+
+	if (!ba_dbus_pcm_get_all(&conn->ctx, &pcms, &length, error))
+		return FALSE;
+
+	free(conn->pcms);
+	conn->pcms = pcms;
+	conn->pcms_len = length;
+	conn->pcms_complete = true;
+	hfpag_dbus_cache_update_last(conn);
+
+	return TRUE;
+}
+
+/**
+ * Keep the PCM cache consistent with the BlueALSA service. */
+static DBusHandlerResult hfpag_dbus_signal_handler(DBusConnection *connection,
+		DBusMessage *message, void *data) {
+	struct hfpag_dbus_conn *conn = data;
+	(void)connection;
+
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	const char *interface = dbus_message_get_interface(message);
+	const char *signal = dbus_message_get_member(message);
+
+	DBusMessageIter iter;
+	if (interface == NULL || signal == NULL ||
+			!dbus_message_iter_init(message, &iter))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (strcmp(interface, DBUS_INTERFACE_OBJECT_MANAGER) == 0) {
+
+		if (strcmp(signal, "InterfacesAdded") == 0) {
+			struct ba_pcm pcm;
+			if (dbus_message_iter_get_ba_pcm(&iter, NULL, &pcm) &&
+					pcm.transport != BA_PCM_TRANSPORT_NONE)
+				/* On allocation failure we can no longer trust the cache. */
+				if (!hfpag_dbus_cache_add(conn, &pcm))
+					hfpag_dbus_cache_clear(conn);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+
+		if (strcmp(signal, "InterfacesRemoved") == 0) {
+			const char *path;
+			if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_OBJECT_PATH)
+				return DBUS_HANDLER_RESULT_HANDLED;
+			dbus_message_iter_get_basic(&iter, &path);
+			if (!dbus_message_iter_next(&iter))
+				return DBUS_HANDLER_RESULT_HANDLED;
+
+			const char *ifaces[8];
+			size_t length = ARRAYSIZE(ifaces);
+			if (!dbus_message_iter_array_get_strings(&iter, NULL, ifaces, &length))
+				return DBUS_HANDLER_RESULT_HANDLED;
+
+			for (size_t i = 0; i < length && i < ARRAYSIZE(ifaces); i++)
+				if (strcmp(ifaces[i], BLUEALSA_INTERFACE_PCM) == 0)
+					hfpag_dbus_cache_remove(conn, path);
+			pthread_cond_broadcast(&conn->updated);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+
+	}
+	else if (strcmp(interface, DBUS_INTERFACE_PROPERTIES) == 0 &&
+			strcmp(signal, "PropertiesChanged") == 0) {
+
+		ssize_t i;
+		if ((i = hfpag_dbus_cache_find(conn, dbus_message_get_path(message))) == -1)
+			return DBUS_HANDLER_RESULT_HANDLED;
+
+		const char *iface;
+		if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+			return DBUS_HANDLER_RESULT_HANDLED;
+		dbus_message_iter_get_basic(&iter, &iface);
+		if (strcmp(iface, BLUEALSA_INTERFACE_PCM) != 0 ||
+				!dbus_message_iter_next(&iter))
+			return DBUS_HANDLER_RESULT_HANDLED;
+
+		/* If the update cannot be parsed, then drop the entry so that it
+		 * is fetched again on the next lookup. */
+		if (!dbus_message_iter_get_ba_pcm_props(&iter, NULL, &conn->pcms[i])) {
+			conn->pcms[i] = conn->pcms[--conn->pcms_len];
+			conn->pcms_complete = false;
+			hfpag_dbus_cache_update_last(conn);
+		}
+
+		pthread_cond_broadcast(&conn->updated);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	else if (strcmp(interface, DBUS_INTERFACE_DBUS) == 0 &&
+			strcmp(signal, "NameOwnerChanged") == 0) {
+		/* BlueALSA service has been started or stopped. */
+		hfpag_dbus_cache_clear(conn);
+		pthread_cond_broadcast(&conn->updated);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Wake up the dispatcher whenever messages are queued, including those read
+ * by other threads while they wait for a method call reply. */
+static void hfpag_dbus_dispatch_status(DBusConnection *connection,
+		DBusDispatchStatus status, void *data) {
+	struct hfpag_dbus_conn *conn = data;
+	(void)connection;
+	if (status == DBUS_DISPATCH_DATA_REMAINS)
+		eventfd_write(conn->dispatcher_event_fd, 1);
+}
+
+static void *hfpag_dbus_dispatcher_thread(void *arg) {
+	struct hfpag_dbus_conn *conn = arg;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	while (!conn->dispatcher_quit) {
+
+		struct pollfd fds[1 + 8] = {
+			{ conn->dispatcher_event_fd, POLLIN, 0 } };
+		nfds_t nfds = ARRAYSIZE(fds) - 1;
+		ba_dbus_connection_poll_fds(&conn->ctx, &fds[1], &nfds);
+
+		pthread_mutex_unlock(&conn->mutex);
+		poll(fds, 1 + nfds, -1);
+		pthread_mutex_lock(&conn->mutex);
+
+		if (fds[0].revents & POLLIN) {
+			eventfd_t value;
+			eventfd_read(conn->dispatcher_event_fd, &value);
+		}
+
+		if (conn->dispatcher_quit)
+			break;
+
+		ba_dbus_connection_poll_dispatch(&conn->ctx, &fds[1], nfds);
+		while (dbus_connection_dispatch(conn->ctx.conn) == DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+
+	}
+
+	pthread_mutex_unlock(&conn->mutex);
+	return NULL;
+}
+
+/**
+ * Must be called with the connection mutex locked. */
+static int hfpag_dbus_dispatcher_start(struct hfpag_dbus_conn *conn) {
+
+	if ((conn->dispatcher_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return -1;
+
+	dbus_connection_set_dispatch_status_function(conn->ctx.conn,
+			hfpag_dbus_dispatch_status, conn, NULL);
+
+	/* Signals must be handled by the application threads. */
+	sigset_t sigset, oldset;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	int err = pthread_create(&conn->dispatcher_tid, NULL, hfpag_dbus_dispatcher_thread, conn);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (err != 0) {
+		dbus_connection_set_dispatch_status_function(conn->ctx.conn, NULL, NULL, NULL);
+		close(conn->dispatcher_event_fd);
+		conn->dispatcher_event_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void hfpag_dbus_dispatcher_stop(struct hfpag_dbus_conn *conn) {
+
+	pthread_mutex_lock(&conn->mutex);
+	conn->dispatcher_quit = true;
+	pthread_mutex_unlock(&conn->mutex);
+
+	eventfd_write(conn->dispatcher_event_fd, 1);
+	pthread_join(conn->dispatcher_tid, NULL);
+
+	dbus_connection_set_dispatch_status_function(conn->ctx.conn, NULL, NULL, NULL);
+	close(conn->dispatcher_event_fd);
+	conn->dispatcher_event_fd = -1;
+}
+
+/**
+ * Register for the signals which keep the PCM cache up to date. */
+static bool hfpag_dbus_signals_init(struct hfpag_dbus_conn *conn) {
+	struct ba_dbus_ctx *ctx = &conn->ctx;
+
+	char name_owner[64];
+	snprintf(name_owner, sizeof(name_owner), "arg0='%s'", ctx->ba_service);
+
+	if (!ba_dbus_connection_signal_match_add(ctx, ctx->ba_service, "/org/bluealsa",
+				DBUS_INTERFACE_OBJECT_MANAGER, "InterfacesAdded", NULL) ||
+			!ba_dbus_connection_signal_match_add(ctx, ctx->ba_service, "/org/bluealsa",
+				DBUS_INTERFACE_OBJECT_MANAGER, "InterfacesRemoved", NULL) ||
+			!ba_dbus_connection_signal_match_add(ctx, ctx->ba_service, NULL,
+				DBUS_INTERFACE_PROPERTIES, "PropertiesChanged",
+				"arg0='" BLUEALSA_INTERFACE_PCM "'") ||
+			!ba_dbus_connection_signal_match_add(ctx, DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+				DBUS_INTERFACE_DBUS, "NameOwnerChanged", name_owner))
+		goto fail;
+
+	if (!dbus_connection_add_filter(ctx->conn, hfpag_dbus_signal_handler, conn, NULL))
+		goto fail;
+
+	if (hfpag_dbus_dispatcher_start(conn) == -1) {
+		dbus_connection_remove_filter(ctx->conn, hfpag_dbus_signal_handler, conn);
+		goto fail;
+	}
+
+	conn->signals = true;
+	return true;
+
+fail:
+	ba_dbus_connection_signal_match_clean(ctx);
+	return false;
+}
+
+/**
+ * Get a reference to the shared D-Bus context for the given BlueALSA service,
+ * creating the connection if this is the first user. The reference must be
+ * released with hfpag_dbus_put(). */
+struct ba_dbus_ctx *hfpag_dbus_get(const char *service, DBusError *error) {
+
+	/* Hook installs may run concurrently in different threads, and the
+	 * connection is then used by all of them. */
+	if (!dbus_threads_init_default()) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&hfpag_dbus_mutex);
+
+	struct hfpag_dbus_conn *conn;
+	for (conn = hfpag_dbus_conns; conn != NULL; conn = conn->next) {
+		if (strncmp(conn->ctx.ba_service, service, sizeof(conn->ctx.ba_service) - 1) == 0) {
+			conn->refcount++;
+			goto final;
+		}
+	}
+
+	if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, NULL);
+		goto final;
+	}
+
+	if (!ba_dbus_connection_ctx_init(&conn->ctx, service, error)) {
+		ba_dbus_connection_ctx_free(&conn->ctx);
+		free(conn);
+		conn = NULL;
+		goto final;
+	}
+
+	pthread_mutex_init(&conn->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&conn->updated, &attr);
+	pthread_condattr_destroy(&attr);
+	conn->dispatcher_event_fd = -1;
+	conn->last_source = -1;
+	conn->last_sink = -1;
+
+	conn->refcount = 1;
+	conn->next = hfpag_dbus_conns;
+	hfpag_dbus_conns = conn;
+
+final:
+	pthread_mutex_unlock(&hfpag_dbus_mutex);
+	return conn != NULL ? &conn->ctx : NULL;
+}
+
+/**
+ * Take an additional reference to a shared D-Bus context. */
+struct ba_dbus_ctx *hfpag_dbus_ref(struct ba_dbus_ctx *ctx) {
+	struct hfpag_dbus_conn *conn = (struct hfpag_dbus_conn *)ctx;
+	pthread_mutex_lock(&hfpag_dbus_mutex);
+	conn->refcount++;
+	pthread_mutex_unlock(&hfpag_dbus_mutex);
+	return ctx;
+}
+
+/**
+ * Release a reference obtained with hfpag_dbus_get() or hfpag_dbus_ref(). The connection is closed
+ * when the last reference is released. */
+void hfpag_dbus_put(struct ba_dbus_ctx *ctx) {
+	struct hfpag_dbus_conn *conn = (struct hfpag_dbus_conn *)ctx;
+
+	pthread_mutex_lock(&hfpag_dbus_mutex);
+
+	if (--conn->refcount > 0) {
+		pthread_mutex_unlock(&hfpag_dbus_mutex);
+		return;
+	}
+
+	struct hfpag_dbus_conn **pconn;
+	for (pconn = &hfpag_dbus_conns; *pconn != NULL; pconn = &(*pconn)->next) {
+		if (*pconn == conn) {
+			*pconn = conn->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&hfpag_dbus_mutex);
+
+	if (conn->signals) {
+		hfpag_dbus_dispatcher_stop(conn);
+		dbus_connection_remove_filter(conn->ctx.conn, hfpag_dbus_signal_handler, conn);
+	}
+	ba_dbus_connection_ctx_free(&conn->ctx);
+	hfpag_dbus_cache_clear(conn);
+	pthread_cond_destroy(&conn->updated);
+	pthread_mutex_destroy(&conn->mutex);
+	free(conn);
+}
+
+/**
+ * Get the BlueALSA SCO PCM for the given device address and mode.
+ *
+ * PCMs are resolved from an in-process cache whenever possible, so repeated
+ * opens of the same device do not need any D-Bus round trips. If the address
+ * is BDADDR_ANY, the most recently connected HFP-AG PCM is returned. */
+dbus_bool_t hfpag_dbus_pcm_get(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int mode,
+		struct ba_pcm *pcm,
+		DBusError *error) {
+	struct hfpag_dbus_conn *conn = (struct hfpag_dbus_conn *)ctx;
+	dbus_bool_t rv = TRUE;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	/* Without signals we cannot tell when the cache is stale, so bypass it. */
+	if (!conn->signals && !hfpag_dbus_signals_init(conn)) {
+		pthread_mutex_unlock(&conn->mutex);
+		return ba_dbus_pcm_get(ctx, addr, BA_PCM_TRANSPORT_MASK_SCO, mode, pcm, error);
+	}
+
+	/* Apply any updates the dispatcher has not processed yet. */
+	ba_dbus_connection_dispatch(ctx);
+
+	if (bacmp(addr, BDADDR_ANY) == 0) {
+
+		if (!conn->pcms_complete &&
+				!(rv = hfpag_dbus_cache_fill(conn, error)))
+			goto final;
+
+		ssize_t i = mode == BA_PCM_MODE_SINK ? conn->last_sink : conn->last_source;
+		if (i == -1) {
+			dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+			rv = FALSE;
+			goto final;
+		}
+
+		memcpy(pcm, &conn->pcms[i], sizeof(*pcm));
+		goto final;
+	}
+
+	for (size_t i = 0; i < conn->pcms_len; i++)
+		if (bacmp(&conn->pcms[i].addr, addr) == 0 &&
+				conn->pcms[i].transport & BA_PCM_TRANSPORT_MASK_SCO &&
+				conn->pcms[i].mode == mode) {
+			memcpy(pcm, &conn->pcms[i], sizeof(*pcm));
+			goto final;
+		}
+
+	/* If the cache is complete then the PCM does not exist. Otherwise we
+	 * have to ask the service. */
+	if (conn->pcms_complete) {
+		dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+		rv = FALSE;
+		goto final;
+	}
+
+	if ((rv = ba_dbus_pcm_get(ctx, addr, BA_PCM_TRANSPORT_MASK_SCO, mode, pcm, error)))
+		hfpag_dbus_cache_add(conn, pcm);
+
+final:
+	pthread_mutex_unlock(&conn->mutex);
+	return rv;
+}
+
+/**
+ * Get both SCO PCMs and the RFCOMM object of a device with a single lookup.
+ * With signals enabled the PCMs are cached, so that the other stream of the
+ * device can be resolved without any further D-Bus traffic. */
+dbus_bool_t hfpag_dbus_device_get(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		struct hfpag_dbus_device *device,
+		DBusError *error) {
+	struct hfpag_dbus_conn *conn = (struct hfpag_dbus_conn *)ctx;
+	dbus_bool_t rv = TRUE;
+
+	device->source.transport = BA_PCM_TRANSPORT_NONE;
+	device->sink.transport = BA_PCM_TRANSPORT_NONE;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	if (!conn->signals && !hfpag_dbus_signals_init(conn)) {
+		if (!(rv = ba_dbus_pcm_get_pair(ctx, addr, BA_PCM_TRANSPORT_MASK_SCO,
+						&device->source, &device->sink, error)))
+			goto final;
+		goto rfcomm;
+	}
+
+	/* Apply any updates the dispatcher has not processed yet. */
+	ba_dbus_connection_dispatch(ctx);
+
+	for (size_t i = 0; i < conn->pcms_len; i++) {
+		const struct ba_pcm *pcm = &conn->pcms[i];
+		if (bacmp(&pcm->addr, addr) != 0 ||
+				!(pcm->transport & BA_PCM_TRANSPORT_MASK_SCO))
+			continue;
+		if (pcm->mode == BA_PCM_MODE_SOURCE)
+			memcpy(&device->source, pcm, sizeof(*pcm));
+		else if (pcm->mode == BA_PCM_MODE_SINK)
+			memcpy(&device->sink, pcm, sizeof(*pcm));
+	}
+
+	/* If the cache is complete then what we have is all there is. */
+	if (conn->pcms_complete ||
+			(device->source.transport != BA_PCM_TRANSPORT_NONE &&
+			 device->sink.transport != BA_PCM_TRANSPORT_NONE))
+		goto rfcomm;
+
+	if (!(rv = ba_dbus_pcm_get_pair(ctx, addr, BA_PCM_TRANSPORT_MASK_SCO,
+					&device->source, &device->sink, error)))
+		goto final;
+
+	if (device->source.transport != BA_PCM_TRANSPORT_NONE)
+		hfpag_dbus_cache_add(conn, &device->source);
+	if (device->sink.transport != BA_PCM_TRANSPORT_NONE)
+		hfpag_dbus_cache_add(conn, &device->sink);
+
+rfcomm:
+	if (device->source.transport == BA_PCM_TRANSPORT_NONE &&
+			device->sink.transport == BA_PCM_TRANSPORT_NONE) {
+		dbus_set_error(error, DBUS_ERROR_FILE_NOT_FOUND, "PCM not found");
+		rv = FALSE;
+		goto final;
+	}
+
+	/* The RFCOMM object path is the BlueALSA counterpart of the BlueZ device
+	 * path: /org/bluez/hciX/dev_XX_XX_XX_XX_XX_XX */
+	const struct ba_pcm *pcm = device->source.transport != BA_PCM_TRANSPORT_NONE ?
+		&device->source : &device->sink;
+	if (strncmp(pcm->device_path, "/org/bluez/", 11) != 0 ||
+			strlen(pcm->device_path) < 37) {
+		dbus_set_error(error, DBUS_ERROR_INVALID_ARGS, "Invalid device path");
+		rv = FALSE;
+		goto final;
+	}
+
+	snprintf(device->rfcomm_path, sizeof(device->rfcomm_path),
+			"/org/bluealsa/%s/rfcomm", pcm->device_path + 11);
+
+final:
+	pthread_mutex_unlock(&conn->mutex);
+	return rv;
+}
+
+/**
+ * Wait until the BlueALSA PCM with the given path is running.
+ *
+ * The Running property is tracked by the PCM cache PropertiesChanged signal
+ * handler, which runs in the connection dispatcher thread, so we just block
+ * until the handler reports an update or the deadline expires.
+ *
+ * Returns 0 if the PCM is running, or -1 if the timeout (in milliseconds)
+ * expired or the PCM is not known. */
+int hfpag_dbus_pcm_wait_running(
+		struct ba_dbus_ctx *ctx,
+		const char *pcm_path,
+		int timeout) {
+	struct hfpag_dbus_conn *conn = (struct hfpag_dbus_conn *)ctx;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	int ret = -1;
+
+	pthread_mutex_lock(&conn->mutex);
+
+	if (!conn->signals)
+		goto final;
+
+	/* Apply any updates the dispatcher has not processed yet. */
+	ba_dbus_connection_dispatch(ctx);
+
+	for (;;) {
+
+		ssize_t i;
+		if ((i = hfpag_dbus_cache_find(conn, pcm_path)) == -1)
+			break;
+		if (conn->pcms[i].running) {
+			ret = 0;
+			break;
+		}
+
+		if (pthread_cond_timedwait(&conn->updated, &conn->mutex, &deadline) == ETIMEDOUT)
+			break;
+
+	}
+
+final:
+	pthread_mutex_unlock(&conn->mutex);
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-dbus.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_DBUS_H_
+#define HFPAG_DBUS_H_
+
+#include <bluetooth/bluetooth.h>
+#include <dbus/dbus.h>
+
+#include "bluez-alsa/dbus-client.h"
+#include "bluez-alsa/dbus-client-pcm.h"
+
+struct ba_dbus_ctx *hfpag_dbus_get(const char *service, DBusError *error);
+struct ba_dbus_ctx *hfpag_dbus_ref(struct ba_dbus_ctx *ctx);
+void hfpag_dbus_put(struct ba_dbus_ctx *ctx);
+
+/**
+ * The BlueALSA objects of a Bluetooth device. A PCM which does not exist has
+ * its transport set to BA_PCM_TRANSPORT_NONE. */
+struct hfpag_dbus_device {
+	struct ba_pcm source;
+	struct ba_pcm sink;
+	char rfcomm_path[128];
+};
+
+dbus_bool_t hfpag_dbus_device_get(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		struct hfpag_dbus_device *device,
+		DBusError *error);
+
+dbus_bool_t hfpag_dbus_pcm_get(
+		struct ba_dbus_ctx *ctx,
+		const bdaddr_t *addr,
+		unsigned int mode,
+		struct ba_pcm *pcm,
+		DBusError *error);
+
+int hfpag_dbus_pcm_wait_running(
+		struct ba_dbus_ctx *ctx,
+		const char *pcm_path,
+		int timeout);
+
+#endif
@@ -11,50 +11,65 @@
 #include <alsa/pcm.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "hfpag-config.h"
+#include "hfpag-dbus.h"
 #include "hfpag-session.h"
+#include "hfpag-worker.h"
 #include "bluez-alsa/dbus-client-pcm.h"
 
 struct bluealsa_hfpag {
-	struct ba_dbus_ctx dbus_ctx;
+	struct ba_dbus_ctx *dbus_ctx;
 	struct hfpag_session *session;
 	bool session_started;
+	/* session transitions are done by the worker thread */
+	bool async;
 };
 
-static int str2bdaddr(const char *str, bdaddr_t *ba) {
-
-	unsigned int x[6];
-	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
-				&x[5], &x[4], &x[3], &x[2], &x[1], &x[0]) != 6)
-		return -1;
-
-	size_t i;
-	for (i = 0; i < 6; i++)
-		ba->b[i] = x[i];
-
-	return 0;
+static void bluealsa_hfpag_session_begin(struct bluealsa_hfpag *hfpag) {
+	int ret = hfpag->async ?
+		hfpag_worker_begin(hfpag->session, hfpag->dbus_ctx) :
+		hfpag_session_begin(hfpag->session, hfpag->dbus_ctx);
+	if (ret == 0)
+		hfpag->session_started = true;
 }
 
 /**
  * Called when snd_pcm_hw_params() is invoked and only *after* hw_params of the
  * slave (BlueALSA) PCM has returned success.
+ *
+ * Applications (and the ALSA plug layer) often call snd_pcm_hw_params() more
+ * than once. The call does not depend on the stream parameters - the SCO codec
+ * is negotiated by BlueALSA - so once the session is started any further call
+ * is a no-op.
  */
 static int bluealsa_hfpag_hw_params(snd_pcm_hook_t *hook) {
 	struct bluealsa_hfpag *hfpag = (struct bluealsa_hfpag*)snd_pcm_hook_get_private(hook);
 
-	if (hfpag_session_begin(hfpag->session, &hfpag->dbus_ctx) == 0)
-		hfpag->session_started = true;
+	/* The session may have been started already when the PCM was opened. */
+	if (!hfpag->session_started)
+		bluealsa_hfpag_session_begin(hfpag);
 
 	return 0;
 }
 
+/**
+ * Called when snd_pcm_hw_free() is invoked, and also by alsa-lib itself every
+ * time before the hardware parameters are set again. The session is therefore
+ * only suspended: if hw_params follows, it picks up the call again without
+ * any signalling, otherwise the call ends shortly after.
+ */
 static int bluealsa_hfpag_hw_free(snd_pcm_hook_t *hook) {
 	struct bluealsa_hfpag *hfpag = (struct bluealsa_hfpag*)snd_pcm_hook_get_private(hook);
 
 	if (hfpag->session_started) {
-		hfpag_session_end(hfpag->session, &hfpag->dbus_ctx);
+		if (hfpag->async)
+			hfpag_worker_suspend(hfpag->session, hfpag->dbus_ctx);
+		else
+			hfpag_session_suspend(hfpag->session, hfpag->dbus_ctx);
 		hfpag->session_started = false;
 	}
 	return 0;
@@ -62,82 +77,128 @@ static int bluealsa_hfpag_hw_free(snd_pcm_hook_t *hook) {
 
 static int bluealsa_hfpag_close(snd_pcm_hook_t *hook) {
 	struct bluealsa_hfpag *hfpag = (struct bluealsa_hfpag*)snd_pcm_hook_get_private(hook);
-	ba_dbus_connection_ctx_free(&hfpag->dbus_ctx);
-	hfpag_session_free(hfpag->session);
+
+	/* With eager call setup the session is active even if hw_params was
+	 * never called, in which case hw_free is not called either. */
+	if (hfpag->async)
+		/* The worker takes over the session and our D-Bus reference. */
+		hfpag_worker_free(hfpag->session, hfpag->dbus_ctx);
+	else {
+		if (hfpag->session_started)
+			hfpag_session_end(hfpag->session, hfpag->dbus_ctx);
+		hfpag_dbus_put(hfpag->dbus_ctx);
+		hfpag_session_free(hfpag->session);
+	}
 	free(hfpag);
 	snd_pcm_hook_set_private(hook, NULL);
 	return 0;
 }
 
+#pragma GCC visibility push(default)
+
+/**
+ * Get a file descriptor which becomes readable each time a session transition
+ * of an hfpag PCM in async mode has completed. The descriptor is an eventfd,
+ * which must be read to clear the event. Returns -1 on error. */
+int bluealsa_hfpag_status_fd(void) {
+	return hfpag_worker_status_fd();
+}
+
+/**
+ * Check whether this process has an active call with the given device.
+ * Returns 1 if so, 0 if not, or -1 if the device is not in use. */
+int bluealsa_hfpag_call_active(const char *device) {
+	bdaddr_t addr;
+	if (hfpag_str2ba(device, &addr) != 0)
+		return -1;
+	return hfpag_session_call_active(&addr);
+}
+
 int bluealsa_hfpag_hook_install(snd_pcm_t *pcm, snd_config_t *conf) {
-	const char *device = "00:00:00:00:00:00";
-	const char *service = "org.bluealsa";
+	struct hfpag_config config;
+	hfpag_config_init(&config);
 	if (conf) {
 		snd_config_iterator_t i, next;
 		snd_config_for_each(i, next, conf) {
 			snd_config_t *node = snd_config_iterator_entry(i);
 			const char *id;
+			int ret;
 			if (snd_config_get_id(node, &id) < 0)
 				continue;
-			if (strcmp(id, "device") == 0) {
-				if (snd_config_get_string(node, &device) < 0) {
-					SNDERR("Invalid type for %s", id);
-					return -EINVAL;
-				}
-				continue;
-			}
-			else if (strcmp(id, "service") == 0) {
-				if (snd_config_get_string(node, &service) < 0) {
-					SNDERR("Invalid type for %s", id);
-					return -EINVAL;
-				}
+			if ((ret = hfpag_config_parse(&config, node, id)) < 0)
+				return ret;
+			if (ret > 0)
 				continue;
-			}
 			SNDERR("Unknown field %s", id);
 				return -EINVAL;
 		}
 	}
 
+	/* BlueALSA reports the PCM as running only once the stream has been
+	 * started, and hooks cannot delay the start. */
+	if (config.ready > 0) {
+		SNDERR("READY is not supported by this PCM, use hfpag_native");
+		return -EINVAL;
+	}
+
+	int ret;
+	bdaddr_t ba_addr;
+	if ((ret = hfpag_config_finish(&config, &ba_addr)) < 0)
+		return ret;
+
 	struct bluealsa_hfpag *hfpag = calloc(1, sizeof(struct bluealsa_hfpag));
 	if (hfpag == NULL)
 		return -ENOMEM;
 
-	int ret = 0;
+	/* Bound the total time spent in our D-Bus calls while opening the PCM.
+	 * The slave bluealsa PCM has been opened already, with its own
+	 * timeouts, before the hooks are installed. */
+	if (config.timeout > 0)
+		ba_dbus_deadline_set(config.timeout);
+
+	DBusError err = DBUS_ERROR_INIT;
 	snd_pcm_hook_t *hook_hw_params = NULL;
 	snd_pcm_hook_t *hook_hw_free = NULL;
 	snd_pcm_hook_t *hook_close = NULL;
 
-	bdaddr_t ba_addr;
-	if (device == NULL || str2bdaddr(device, &ba_addr) != 0) {
-		SNDERR("Invalid BT device address: %s", device);
-		ret = EINVAL;
+	if ((hfpag->dbus_ctx = hfpag_dbus_get(config.service, &err)) == NULL) {
+		SNDERR("Couldn't initialize D-Bus context: %s", err.message);
+		ret = -EIO;
 		goto fail;
 	}
 
-	DBusError err = DBUS_ERROR_INIT;
+	const unsigned int mode = snd_pcm_stream(pcm) == SND_PCM_STREAM_PLAYBACK ?
+		BA_PCM_MODE_SINK : BA_PCM_MODE_SOURCE;
 
-	if (!ba_dbus_connection_ctx_init(&hfpag->dbus_ctx, service, &err)) {
-		SNDERR("Couldn't initialize D-Bus context: %s", err.message);
-		dbus_error_free(&err);
-		return -EIO;
+	/* Resolve the default device to the most recently connected one. */
+	if (bacmp(&ba_addr, BDADDR_ANY) == 0) {
+		struct ba_pcm ba_pcm;
+		if (!hfpag_dbus_pcm_get(hfpag->dbus_ctx, &ba_addr, mode, &ba_pcm, &err)) {
+			SNDERR("Couldn't get BlueALSA PCM: %s", err.message);
+			ret = -ENODEV;
+			goto fail;
+		}
+		bacpy(&ba_addr, &ba_pcm.addr);
 	}
 
-	struct ba_pcm ba_pcm = { 0 };
-	if (!ba_dbus_pcm_get(&hfpag->dbus_ctx,
-				&ba_addr,
-				BA_PCM_TRANSPORT_MASK_SCO,
-				snd_pcm_stream(pcm) == SND_PCM_STREAM_PLAYBACK ? BA_PCM_MODE_SINK : BA_PCM_MODE_SOURCE,
-				&ba_pcm,
-				&err)) {
+	/* Both PCMs of the device are resolved at once, so the other stream of
+	 * a full-duplex application does not need another lookup. */
+	struct hfpag_dbus_device ba_device;
+	if (!hfpag_dbus_device_get(hfpag->dbus_ctx, &ba_addr, &ba_device, &err)) {
 		SNDERR("Couldn't get BlueALSA PCM: %s", err.message);
 		ret = -ENODEV;
 		goto fail;
 	}
 
-	if (!(ba_pcm.transport & BA_PCM_TRANSPORT_HFP_AG))
+	const struct ba_pcm *ba_pcm = mode == BA_PCM_MODE_SINK ?
+		&ba_device.sink : &ba_device.source;
+	if (!(ba_pcm->transport & BA_PCM_TRANSPORT_HFP_AG))
 		goto fail;
 
-	if (hfpag_session_init(&hfpag->session, ba_pcm.device_path, &ba_pcm.addr) < 0) {
+	hfpag->async = config.async;
+
+	if ((ret = hfpag_session_init(&hfpag->session, hfpag->dbus_ctx->ba_service,
+					ba_device.rfcomm_path, &ba_pcm->addr, config.lock, config.linger)) < 0) {
 		SNDERR("Cannot initialize HFP call session");
 		goto fail;
 	}
@@ -151,10 +212,18 @@ int bluealsa_hfpag_hook_install(snd_pcm_t *pcm, snd_config_t *conf) {
 	if ((ret = snd_pcm_hook_add(&hook_close, pcm, SND_PCM_HOOK_TYPE_CLOSE, bluealsa_hfpag_close, hfpag)) < 0)
 		goto fail;
 
+	/* Start the call now, so that the HF can set up the SCO link while the
+	 * application is still configuring the PCM. */
+	if (config.eager)
+		bluealsa_hfpag_session_begin(hfpag);
+
+	ba_dbus_deadline_set(-1);
 	return 0;
 
 fail:
-	ba_dbus_connection_ctx_free(&hfpag->dbus_ctx);
+	ba_dbus_deadline_set(-1);
+	if (hfpag->dbus_ctx != NULL)
+		hfpag_dbus_put(hfpag->dbus_ctx);
 	dbus_error_free(&err);
 	if (hfpag->session != NULL)
 		hfpag_session_free(hfpag->session);
@@ -168,3 +237,5 @@ fail:
 	return ret;
 }
 SND_DLSYM_BUILD_VERSION(bluealsa_hfpag_hook_install, SND_PCM_DLSYM_VERSION);
+
+#pragma GCC visibility pop
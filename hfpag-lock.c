@@ -0,0 +1,552 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-lock.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-lock.h"
+
+#define BLUEALSA_HFPAG_MUTEX_OFFSET 0
+#define BLUEALSA_HFPAG_FLAG_OFFSET 1
+
+/* maximum number of streams using a device with the socket backend */
+#define BLUEALSA_HFPAG_SOCKET_SLOTS 32
+
+static const char *get_lock_dir(void) {
+
+	/* If /dev/shm is available and usable, we prefer it. */
+	char *lockdir = "/dev/shm";
+	if (faccessat(0, lockdir, R_OK|W_OK, AT_EACCESS) < 0) {
+		/* FIXME - if the capture and playback applications run in different
+		 * environments they may not see the same lock file. We really need a
+		 * more reliable way of agreeing a path for the lock file when /dev/shm
+		 * cannot be used. */
+		lockdir = getenv("XDG_RUNTIME_DIR");
+		if (lockdir == NULL) {
+			lockdir = getenv("TMPDIR");
+			if (lockdir == NULL)
+				lockdir = "/tmp";
+		}
+	}
+
+	return lockdir;
+}
+
+static socklen_t hfpag_socket_addr(struct sockaddr_un *addr, const char *prefix, const char *name) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	int len = snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1,
+			"%s/%s", prefix, name);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/**
+ * Create a socket bound to the given name in the abstract namespace. Returns
+ * the socket, or -1 on error with errno set (EADDRINUSE if the name is taken
+ * by another socket). */
+static int hfpag_socket_bind(const char *prefix, const char *name) {
+
+	struct sockaddr_un addr;
+	socklen_t addrlen = hfpag_socket_addr(&addr, prefix, name);
+
+	int fd;
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Get the time in milliseconds remaining until the deadline, or -1 if there
+ * is no deadline. */
+static int hfpag_lock_remaining(const struct timespec *deadline) {
+
+	if (deadline == NULL)
+		return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long remaining = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * Anybody can bind a name in the abstract namespace, so make sure that the
+ * mutex is held by our user (or by root), and not by somebody squatting on
+ * the name to block us. */
+static bool hfpag_socket_peer_allowed(int fd) {
+	struct ucred cred = { .uid = (uid_t)-1 };
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+			(cred.uid != getuid() && cred.uid != 0)) {
+		SNDERR("Session lock held by another user: uid %d", (int)cred.uid);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Acquire the per-device mutex. The mutex is held by whoever owns the socket
+ * bound to the mutex name, so it is released automatically by the kernel if
+ * the holder dies. Waits for at most timeout milliseconds, or without bound
+ * if timeout is negative. Returns -1 with errno set to EAGAIN if the mutex is
+ * held by somebody else for longer than that. */
+static int hfpag_socket_mutex_lock(const char *prefix, int timeout) {
+
+	struct timespec deadline;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	int fd;
+	while ((fd = hfpag_socket_bind(prefix, "lock")) == -1) {
+
+		if (errno != EADDRINUSE)
+			return -1;
+
+		struct sockaddr_un addr;
+		socklen_t addrlen = hfpag_socket_addr(&addr, prefix, "lock");
+		if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+			return -1;
+
+		/* The connection is reset when the holder closes the mutex socket,
+		 * so wait for that to happen. If the connection is refused then the
+		 * mutex has just been released. If the backlog of the holder is
+		 * full, there are other waiters, so just try again a bit later. */
+		const int remaining = hfpag_lock_remaining(timeout >= 0 ? &deadline : NULL);
+		if (connect(fd, (struct sockaddr *)&addr, addrlen) == 0) {
+			if (!hfpag_socket_peer_allowed(fd)) {
+				close(fd);
+				errno = EPERM;
+				return -1;
+			}
+			struct pollfd pfd = { fd, 0, 0 };
+			poll(&pfd, 1, remaining);
+		}
+		else if (errno == EAGAIN && remaining != 0)
+			poll(NULL, 0, remaining == -1 ? 10 : MIN(remaining, 10));
+
+		close(fd);
+
+		if (remaining == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+	}
+
+	/* Allow the waiters to connect. */
+	if (listen(fd, BLUEALSA_HFPAG_SOCKET_SLOTS) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Count the participant slots which are in use. Must be called with the
+ * mutex held. */
+static unsigned int hfpag_socket_slots_used(const char *prefix) {
+
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < BLUEALSA_HFPAG_SOCKET_SLOTS; i++) {
+		char name[8];
+		snprintf(name, sizeof(name), "%u", i);
+		int fd;
+		if ((fd = hfpag_socket_bind(prefix, name)) != -1)
+			close(fd);
+		else if (errno == EADDRINUSE)
+			count++;
+	}
+
+	return count;
+}
+
+/**
+ * Take a free participant slot. Must be called with the mutex held. */
+static int hfpag_socket_slot_bind(const char *prefix) {
+
+	int fd = -1;
+	for (unsigned int i = 0; i < BLUEALSA_HFPAG_SOCKET_SLOTS; i++) {
+		char name[8];
+		snprintf(name, sizeof(name), "%u", i);
+		if ((fd = hfpag_socket_bind(prefix, name)) != -1 ||
+				errno != EADDRINUSE)
+			break;
+	}
+
+	return fd;
+}
+
+/**
+ * Each stream using the device holds a socket bound to one of a fixed set of
+ * participant slot names. The first and last users are detected by probing
+ * the slots while holding the per-device mutex. Abstract sockets are scoped
+ * by network namespace, need no shared directory, and disappear when closed,
+ * so there is no stale state to clean up. */
+static int hfpag_lock_join_socket(struct hfpag_lock *lock, bool *first, int timeout) {
+
+	int mutex_fd;
+	if ((mutex_fd = hfpag_socket_mutex_lock(lock->name, timeout)) == -1) {
+		if (errno != EAGAIN || timeout != 0)
+			SNDERR("Unable to lock session: %s", strerror(errno));
+		return -1;
+	}
+
+	int fd;
+	if ((fd = hfpag_socket_slot_bind(lock->name)) == -1) {
+		SNDERR("Unable to join session: %s", strerror(errno));
+		close(mutex_fd);
+		return -1;
+	}
+
+	/* We are (currently) the only stream using this HFP device */
+	*first = hfpag_socket_slots_used(lock->name) == 1;
+
+	lock->fd = fd;
+	lock->mutex_fd = mutex_fd;
+	return 0;
+}
+
+static int hfpag_lock_leave_socket(struct hfpag_lock *lock, bool *last, int timeout) {
+
+	int mutex_fd;
+	if ((mutex_fd = hfpag_socket_mutex_lock(lock->name, timeout)) == -1) {
+		if (errno == EAGAIN && timeout == 0)
+			return -1;
+		SNDERR("Unable to lock session: %s", strerror(errno));
+		close(lock->fd);
+		lock->fd = -1;
+		return -1;
+	}
+
+	close(lock->fd);
+	lock->fd = -1;
+
+	*last = hfpag_socket_slots_used(lock->name) == 0;
+
+	lock->mutex_fd = mutex_fd;
+	return 0;
+}
+
+/**
+ * We use Linux-specific Open File Descriptor Locking to coordinate with other
+ * processes, since neither POSIX nor BSD file locks have the necessary
+ * semantics. File locks cannot be waited for with a timeout, so unless the
+ * timeout is 0 (do not wait at all), we wait for as long as it takes. */
+static int hfpag_lock_join_file(struct hfpag_lock *lock, bool *first, int timeout) {
+
+	/* lock to ensure exclusive access to the call session state. */
+	struct flock mutex_lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_MUTEX_OFFSET,
+		.l_len = 1,
+	};
+
+	/* shared lock held continuously while call session is active. */
+	struct flock flag_lock = {
+		.l_type = F_RDLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_FLAG_OFFSET,
+		.l_len = 1,
+	};
+
+	int fd;
+	int err;
+	int retries = 5;
+	while (retries > 0) {
+		fd = open(lock->name, O_CREAT|O_CLOEXEC|O_RDWR, S_IRUSR|S_IWUSR);
+		if (fd == -1) {
+			SNDERR("Unable to open lock file");
+			return -1;
+		}
+
+		/* Wait for mutex lock before managing call state. */
+		err = fcntl(fd, timeout == 0 ? F_OFD_SETLK : F_OFD_SETLKW, &mutex_lock);
+		if (err == -1) {
+			err = errno;
+			if (err != EAGAIN || timeout != 0)
+				SNDERR("Unable to set lock file");
+			close(fd);
+			errno = err;
+			return -1;
+		}
+
+		/* There is a chance that the lock file was unlinked while this process
+		 * was waiting for the mutex. In that case the descriptor fd is no
+		 * longer referring to the correct file. So we check that we are indeed
+		 * looking at the correct file path by comparing the inode of the fd
+		 * with the current inode of the lock file path. */
+		struct stat fd_stat;
+		if (fstat(fd, &fd_stat) < 0) {
+			SNDERR("Unable to check lock file");
+			close(fd);
+			return -1;
+		}
+		struct stat path_stat;
+		err = stat(lock->name, &path_stat);
+		if (err < 0 && errno != ENOENT) {
+			SNDERR("Unable to check lock file");
+			close(fd);
+			return -1;
+		}
+		if (errno == ENOENT || fd_stat.st_ino != path_stat.st_ino) {
+			/* The lock file we opened is no longer valid - try again. */
+			close(fd);
+			fd = -1;
+			--retries;
+			continue;
+		}
+
+		break;
+	}
+	if (fd == -1) {
+		SNDERR("Unable to open lock file - maximum retries exceeded");
+		return -1;
+	}
+
+	/* set flag lock to indicate we are using this HFP device. */
+	err = fcntl(fd, F_OFD_SETLKW, &flag_lock);
+	if (err == -1) {
+		SNDERR("Unable to set lock file");
+		close(fd);
+		return -1;
+	}
+
+	/* test if we can switch flag to an exclusive lock - if so no other process
+	 * (or thread) is using this HFP device. */
+	*first = false;
+	flag_lock.l_type = F_WRLCK;
+	err = fcntl(fd, F_OFD_SETLK, &flag_lock);
+	if (err == -1) {
+		if (errno != EAGAIN) {
+			SNDERR("Unable to test lock file");
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		/* We are (currently) the only process using this HFP device */
+		*first = true;
+
+		/* Revert the flag to a shared lock */
+		flag_lock.l_type = F_RDLCK;
+		err = fcntl(fd, F_OFD_SETLK, &flag_lock);
+	}
+
+	lock->fd = fd;
+	return 0;
+}
+
+/**
+ * On error the lock file is closed, which gives up our part in the call
+ * session. */
+static int hfpag_lock_leave_file(struct hfpag_lock *lock, bool *last, int timeout) {
+
+	struct flock mutex_lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_MUTEX_OFFSET,
+		.l_len = 1,
+	};
+
+	struct flock flag_lock = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_FLAG_OFFSET,
+		.l_len = 1,
+	};
+
+	/* Wait for mutex lock before managing call state. */
+	int err = fcntl(lock->fd, timeout == 0 ? F_OFD_SETLK : F_OFD_SETLKW, &mutex_lock);
+	if (err == -1) {
+		if (errno == EAGAIN && timeout == 0)
+			return -1;
+		SNDERR("Unable to set lock file");
+		goto fail;
+	}
+
+	/* test if we can switch the flag to an exclusive lock - if so no other
+	 * process (or thread) is using this HFP device. */
+	*last = true;
+	err = fcntl(lock->fd, F_OFD_SETLK, &flag_lock);
+	if (err == -1) {
+		if (errno != EAGAIN) {
+			SNDERR("Unable to test lock file");
+			goto fail;
+		}
+		*last = false;
+	}
+
+	return 0;
+
+fail:
+	/* closing the lock file automatically releases all locks */
+	close(lock->fd);
+	lock->fd = -1;
+	return -1;
+}
+
+void hfpag_lock_init(struct hfpag_lock *lock, enum hfpag_session_lock type,
+		const bdaddr_t *addr) {
+
+	if (type == HFPAG_SESSION_LOCK_SOCKET)
+		snprintf(lock->name, sizeof(lock->name),
+				"bluealsa-hfpag/%.2X:%.2X:%.2X:%.2X:%.2X:%.2X",
+				addr->b[5], addr->b[4], addr->b[3],
+				addr->b[2], addr->b[1], addr->b[0]);
+	else
+		snprintf(lock->name, sizeof(lock->name),
+				"%s/bahfpag%.2X%.2X%.2X%.2X%.2X%.2X.lock",
+				get_lock_dir(),
+				addr->b[5], addr->b[4], addr->b[3],
+				addr->b[2], addr->b[1], addr->b[0]);
+
+	lock->type = type;
+	lock->fd = -1;
+	lock->mutex_fd = -1;
+	lock->leaving = false;
+	lock->last = false;
+}
+
+/**
+ * Join the call session of the device. On success the per-device mutex is
+ * held, and first tells whether no other stream is using the device, in
+ * which case the caller shall start the call. The mutex is waited for at
+ * most timeout milliseconds (without bound if negative). If it is busy for
+ * longer, -1 is returned with errno set to EAGAIN, and nothing is changed. */
+int hfpag_lock_join(struct hfpag_lock *lock, bool *first, int timeout) {
+	lock->leaving = false;
+	return lock->type == HFPAG_SESSION_LOCK_SOCKET ?
+		hfpag_lock_join_socket(lock, first, timeout) :
+		hfpag_lock_join_file(lock, first, timeout);
+}
+
+/**
+ * Leave the call session of the device. On success the per-device mutex is
+ * held, and last tells whether no other stream is using the device, in which
+ * case the caller shall terminate the call. Our part in the session is over
+ * once the mutex has been released, even if this function fails - unless the
+ * timeout is 0 and the mutex is busy (EAGAIN), in which case the caller is
+ * still in the session and may try again. */
+int hfpag_lock_leave(struct hfpag_lock *lock, bool *last, int timeout) {
+
+	int ret = lock->type == HFPAG_SESSION_LOCK_SOCKET ?
+		hfpag_lock_leave_socket(lock, last, timeout) :
+		hfpag_lock_leave_file(lock, last, timeout);
+
+	if (ret == 0) {
+		lock->leaving = true;
+		lock->last = *last;
+	}
+
+	return ret;
+}
+
+/**
+ * Undo a successful hfpag_lock_join() or hfpag_lock_leave(), and release the
+ * per-device mutex. This lets a caller which needs several locks take all of
+ * them or none, without waiting for any of them. */
+void hfpag_lock_cancel(struct hfpag_lock *lock) {
+
+	if (!lock->leaving) {
+		/* closing our descriptors gives up our part in the session */
+		if (lock->type == HFPAG_SESSION_LOCK_SOCKET) {
+			close(lock->mutex_fd);
+			lock->mutex_fd = -1;
+		}
+		close(lock->fd);
+		lock->fd = -1;
+		return;
+	}
+
+	lock->leaving = false;
+
+	if (lock->type == HFPAG_SESSION_LOCK_SOCKET) {
+		/* We still hold the mutex, so nobody has noticed that we left. */
+		if ((lock->fd = hfpag_socket_slot_bind(lock->name)) == -1)
+			SNDERR("Unable to rejoin session: %s", strerror(errno));
+		hfpag_lock_release(lock);
+		return;
+	}
+
+	/* Revert the flag to a shared lock, in case we were the last user. */
+	struct flock flag_lock = {
+		.l_type = F_RDLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_FLAG_OFFSET,
+		.l_len = 1,
+	};
+
+	if (fcntl(lock->fd, F_OFD_SETLK, &flag_lock) == -1)
+		SNDERR("Unable to reset lock file");
+	hfpag_lock_release(lock);
+
+}
+
+/**
+ * Release the per-device mutex taken by hfpag_lock_join() or by
+ * hfpag_lock_leave(). */
+void hfpag_lock_release(struct hfpag_lock *lock) {
+
+	if (lock->type == HFPAG_SESSION_LOCK_SOCKET) {
+		close(lock->mutex_fd);
+		lock->mutex_fd = -1;
+		return;
+	}
+
+	if (lock->leaving) {
+		/* Nobody else uses the lock file, so it is safe to remove it;
+		 * anybody waiting for our mutex will notice and start over. */
+		if (lock->last)
+			unlink(lock->name);
+		/* closing the lock file automatically releases all locks */
+		close(lock->fd);
+		lock->fd = -1;
+		return;
+	}
+
+	struct flock mutex_lock = {
+		.l_type = F_UNLCK,
+		.l_whence = SEEK_SET,
+		.l_start = BLUEALSA_HFPAG_MUTEX_OFFSET,
+		.l_len = 1,
+	};
+
+	if (fcntl(lock->fd, F_OFD_SETLK, &mutex_lock) == -1)
+		SNDERR("Unable to release lock file");
+
+}
@@ -0,0 +1,45 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-lock.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_LOCK_H_
+#define HFPAG_LOCK_H_
+
+#include <bluetooth/bluetooth.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include "hfpag-session.h"
+
+/**
+ * Our part in the call state of a device, agreed with the other processes
+ * using the device. Every participant holds the lock; the first one to join
+ * starts the call and the last one to leave terminates it. Joining and
+ * leaving return with the per-device mutex held, so that the call can be
+ * started or terminated before anybody else looks at the state, and the
+ * mutex must then be given back with hfpag_lock_release(). */
+struct hfpag_lock {
+	/* HFPAG_SESSION_LOCK_FILE or HFPAG_SESSION_LOCK_SOCKET */
+	enum hfpag_session_lock type;
+	/* lock file path, or socket name prefix for the socket backend */
+	char name[PATH_MAX + 1];
+	/* lock file or participant slot socket, -1 if not joined */
+	int fd;
+	/* mutex socket of the socket backend, -1 if not held */
+	int mutex_fd;
+	/* the mutex is held to leave, and we were the last participant */
+	bool leaving;
+	bool last;
+};
+
+void hfpag_lock_init(struct hfpag_lock *lock, enum hfpag_session_lock type,
+		const bdaddr_t *addr);
+int hfpag_lock_join(struct hfpag_lock *lock, bool *first, int timeout);
+int hfpag_lock_leave(struct hfpag_lock *lock, bool *last, int timeout);
+void hfpag_lock_cancel(struct hfpag_lock *lock);
+void hfpag_lock_release(struct hfpag_lock *lock);
+
+#endif
@@ -0,0 +1,1041 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-pcm.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-config.h"
+#include "hfpag-convert.h"
+#include "hfpag-dbus.h"
+#include "hfpag-resample.h"
+#include "hfpag-sco.h"
+#include "hfpag-session.h"
+#include "hfpag-worker.h"
+#include "bluez-alsa/dbus-client-pcm.h"
+#include "bluez-alsa/defs.h"
+
+/* time in milliseconds to wait for a response on the control socket */
+#define HFPAG_PCM_CTRL_TIMEOUT 500
+
+/* maximum number of period sizes offered for an SCO codec */
+#define HFPAG_PCM_PERIOD_SIZES 256
+
+/* number of frames converted at a time, small enough to stay in the cache */
+#define HFPAG_PCM_CONVERT_FRAMES 512
+
+/**
+ * ALSA ioplug PCM which transfers audio directly on the BlueALSA PCM pipe,
+ * without the bluealsa plugin and its D-Bus connection in between. */
+struct hfpag_pcm {
+	snd_pcm_ioplug_t io;
+
+	struct ba_dbus_ctx *dbus_ctx;
+	struct hfpag_session *session;
+	bool session_started;
+	/* session transitions are done by the worker thread */
+	bool async;
+	/* time in milliseconds to wait for the SCO link in start */
+	unsigned int ready;
+
+	/* BlueALSA PCM as it was when the PCM was opened */
+	struct ba_pcm ba_pcm;
+	/* BlueALSA PCM pipe and control socket */
+	int fd;
+	int fd_ctrl;
+
+	/* period timer, used as the poll descriptor */
+	int fd_timer;
+	/* size of the BlueALSA PCM pipe in bytes */
+	size_t pipe_size;
+	size_t frame_size;
+	snd_pcm_uframes_t avail_min;
+
+	/* feed BlueALSA at the SCO packet rate */
+	bool cadence;
+	struct hfpag_sco *sco;
+
+	/* application rate, if not 0 and different from the BlueALSA one,
+	 * the audio is resampled by the plugin */
+	unsigned int rate;
+	struct hfpag_resample *resample;
+	/* audio on its way between the resampler and BlueALSA */
+	int16_t *resample_buffer;
+	size_t resample_buffer_frames;
+	/* resampled playback frames not yet taken by BlueALSA */
+	size_t resample_pending;
+
+	/* conversion between the application format and S16 mono, if the
+	 * application does not use the BlueALSA format */
+	hfpag_convert_t convert;
+	size_t convert_frame_size;
+
+	/* frames transferred by the application since the last prepare */
+	uint64_t transferred;
+	/* frames at the BlueALSA rate passed to or taken from BlueALSA */
+	uint64_t ba_transferred;
+};
+
+static snd_pcm_format_t hfpag_pcm_get_format(unsigned int format) {
+	switch (format) {
+	case 0x0108:
+		return SND_PCM_FORMAT_U8;
+	case 0x8210:
+		return SND_PCM_FORMAT_S16_LE;
+	case 0x8318:
+		return SND_PCM_FORMAT_S24_3LE;
+	case 0x8418:
+		return SND_PCM_FORMAT_S24_LE;
+	case 0x8420:
+		return SND_PCM_FORMAT_S32_LE;
+	default:
+		return SND_PCM_FORMAT_UNKNOWN;
+	}
+}
+
+/**
+ * Convert a number of frames at the BlueALSA rate to the application rate. */
+static snd_pcm_sframes_t hfpag_pcm_frames_to_io(struct hfpag_pcm *pcm,
+		snd_pcm_sframes_t frames) {
+	if (pcm->resample == NULL)
+		return frames;
+	return (int64_t)frames * pcm->io.rate / pcm->ba_pcm.rate;
+}
+
+/**
+ * Get the number of frames queued in the SCO cadence adapter ring and in the
+ * BlueALSA PCM pipe, at the BlueALSA rate. Frames captured into the pipe are
+ * not counted while the adapter is used, because the application cannot read
+ * them yet. On Linux FIONREAD works for either end of the pipe. */
+static snd_pcm_sframes_t hfpag_pcm_ba_queued(struct hfpag_pcm *pcm) {
+
+	snd_pcm_sframes_t frames = 0;
+	if (pcm->sco != NULL) {
+		frames = hfpag_sco_queued(pcm->sco);
+		if (pcm->io.stream == SND_PCM_STREAM_CAPTURE)
+			return frames;
+	}
+
+	int size;
+	if (ioctl(pcm->fd, FIONREAD, &size) == -1)
+		return -errno;
+	return frames + size / pcm->frame_size;
+}
+
+/**
+ * Get the number of frames queued between the application and BlueALSA, at
+ * the application rate. For playback it is derived from the frames BlueALSA
+ * has consumed, because the resampler may emit frames ahead of the input it
+ * has been given, and it never exceeds what the application has written. */
+static snd_pcm_sframes_t hfpag_pcm_queued(struct hfpag_pcm *pcm) {
+
+	snd_pcm_sframes_t frames;
+	if ((frames = hfpag_pcm_ba_queued(pcm)) < 0)
+		return frames;
+
+	if (pcm->io.stream == SND_PCM_STREAM_CAPTURE)
+		return hfpag_pcm_frames_to_io(pcm, frames);
+
+	const uint64_t consumed = pcm->ba_transferred - MIN((uint64_t)frames, pcm->ba_transferred);
+	return pcm->transferred - MIN((uint64_t)hfpag_pcm_frames_to_io(pcm, consumed),
+			pcm->transferred);
+}
+
+static int hfpag_pcm_timer_set(struct hfpag_pcm *pcm, bool enable) {
+	struct itimerspec ts = { 0 };
+	if (enable) {
+		const uint64_t ns = (uint64_t)pcm->io.period_size * 1000000000 / pcm->io.rate;
+		ts.it_interval.tv_sec = ns / 1000000000;
+		ts.it_interval.tv_nsec = ns % 1000000000;
+		ts.it_value = ts.it_interval;
+	}
+	if (timerfd_settime(pcm->fd_timer, 0, &ts, NULL) == -1)
+		return -errno;
+	return 0;
+}
+
+static int hfpag_pcm_ctrl(struct hfpag_pcm *pcm, const char *command) {
+	DBusError err = DBUS_ERROR_INIT;
+	if (!ba_dbus_pcm_ctrl_send(pcm->fd_ctrl, command, HFPAG_PCM_CTRL_TIMEOUT, &err)) {
+		SNDERR("Couldn't send %s command: %s", command, err.message);
+		dbus_error_free(&err);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void hfpag_pcm_session_begin(struct hfpag_pcm *pcm) {
+	int ret = pcm->async ?
+		hfpag_worker_begin(pcm->session, pcm->dbus_ctx) :
+		hfpag_session_begin(pcm->session, pcm->dbus_ctx);
+	if (ret == 0)
+		pcm->session_started = true;
+}
+
+/**
+ * Suspend the session rather than ending it, because alsa-lib calls hw_free
+ * every time before the hardware parameters are set again. If hw_params
+ * follows, the call is picked up again without any signalling. */
+static void hfpag_pcm_session_suspend(struct hfpag_pcm *pcm) {
+	if (!pcm->session_started)
+		return;
+	if (pcm->async)
+		hfpag_worker_suspend(pcm->session, pcm->dbus_ctx);
+	else
+		hfpag_session_suspend(pcm->session, pcm->dbus_ctx);
+	pcm->session_started = false;
+}
+
+/**
+ * Wait for the HF to accept the call and bring up the SCO link. */
+static void hfpag_pcm_wait_ready(struct hfpag_pcm *pcm) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (hfpag_dbus_pcm_wait_running(pcm->dbus_ctx, pcm->ba_pcm.pcm_path, pcm->ready) != 0) {
+		SNDERR("SCO link not running after %u ms", pcm->ready);
+		return;
+	}
+
+	if (getenv("BLUEALSA_HFPAG_DEBUG") != NULL) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		SNDERR("%s: SCO link running after %ld ms", pcm->ba_pcm.pcm_path,
+				(now.tv_sec - ts.tv_sec) * 1000 + (now.tv_nsec - ts.tv_nsec) / 1000000);
+	}
+
+}
+
+static int hfpag_pcm_start(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+	int ret;
+	if ((ret = hfpag_pcm_ctrl(pcm, "Resume")) < 0)
+		return ret;
+	if (pcm->sco != NULL &&
+			(ret = hfpag_sco_start(pcm->sco)) < 0)
+		return ret;
+	/* BlueALSA reports the PCM as running only once audio flows, which
+	 * needs the SCO link and the stream to be started. In async mode the
+	 * call may not even be started yet, and waiting for it would defeat
+	 * the purpose. */
+	if (pcm->session_started && pcm->ready > 0 && !pcm->async)
+		hfpag_pcm_wait_ready(pcm);
+	return hfpag_pcm_timer_set(pcm, true);
+}
+
+static int hfpag_pcm_stop(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+	hfpag_pcm_timer_set(pcm, false);
+	if (pcm->sco != NULL)
+		hfpag_sco_stop(pcm->sco);
+	return hfpag_pcm_ctrl(pcm, "Pause");
+}
+
+/**
+ * The hardware position follows the BlueALSA side of the pipe: for playback
+ * it is what BlueALSA has consumed, but never more than we have written, for
+ * capture it is what we have read plus what is already queued. */
+static snd_pcm_sframes_t hfpag_pcm_pointer(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	snd_pcm_sframes_t queued;
+	if ((queued = hfpag_pcm_queued(pcm)) < 0)
+		return queued;
+
+	if (pcm->sco != NULL && hfpag_sco_overrun(pcm->sco))
+		return -EPIPE;
+
+	uint64_t hw_ptr = pcm->transferred;
+	if (io->stream == SND_PCM_STREAM_PLAYBACK)
+		hw_ptr -= queued;
+	else {
+		if ((snd_pcm_uframes_t)queued > io->buffer_size)
+			return -EPIPE;
+		hw_ptr += queued;
+	}
+
+	return hw_ptr % io->buffer_size;
+}
+
+/**
+ * Transfer frames at the BlueALSA rate to or from BlueALSA. Returns the
+ * number of frames transferred, which may be less than requested. */
+static snd_pcm_sframes_t hfpag_pcm_ba_transfer(struct hfpag_pcm *pcm,
+		void *buffer, snd_pcm_uframes_t size) {
+
+	/* The ring holds at least the whole buffer. */
+	if (pcm->sco != NULL) {
+		size = pcm->io.stream == SND_PCM_STREAM_PLAYBACK ?
+			hfpag_sco_write(pcm->sco, buffer, size) :
+			hfpag_sco_read(pcm->sco, buffer, size);
+		pcm->ba_transferred += size;
+		return size;
+	}
+
+	size_t len = size * pcm->frame_size;
+	size_t done = 0;
+
+	/* The buffer size is limited to the pipe size, so the pipe always has
+	 * room for what the application may write, and holds what it may read;
+	 * the loop only has to cope with partial transfers. */
+	while (done < len) {
+		ssize_t ret = pcm->io.stream == SND_PCM_STREAM_PLAYBACK ?
+			write(pcm->fd, (uint8_t *)buffer + done, len - done) :
+			read(pcm->fd, (uint8_t *)buffer + done, len - done);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && errno == EAGAIN)
+			break;
+		if (ret == -1)
+			return -errno;
+		if (ret == 0)
+			return -EPIPE;
+		done += ret;
+	}
+
+	/* Do not split frames. */
+	if (done % pcm->frame_size != 0) {
+		SNDERR("Partial frame transferred");
+		return -EIO;
+	}
+
+	pcm->ba_transferred += done / pcm->frame_size;
+	return done / pcm->frame_size;
+}
+
+/**
+ * Pass the resampled frames left over by a previous transfer to BlueALSA.
+ * Returns the number of frames still pending. */
+static snd_pcm_sframes_t hfpag_pcm_resample_flush(struct hfpag_pcm *pcm) {
+
+	if (pcm->resample_pending == 0)
+		return 0;
+
+	snd_pcm_sframes_t ret;
+	if ((ret = hfpag_pcm_ba_transfer(pcm, pcm->resample_buffer, pcm->resample_pending)) < 0)
+		return ret;
+
+	pcm->resample_pending -= ret;
+	memmove(pcm->resample_buffer, pcm->resample_buffer + ret,
+			pcm->resample_pending * pcm->frame_size);
+
+	return pcm->resample_pending;
+}
+
+static snd_pcm_sframes_t hfpag_pcm_resample_write(struct hfpag_pcm *pcm,
+		const int16_t *buffer, snd_pcm_uframes_t size) {
+
+	snd_pcm_sframes_t ret;
+	if ((ret = hfpag_pcm_resample_flush(pcm)) != 0)
+		return ret < 0 ? ret : 0;
+
+	size_t in_frames = size;
+	size_t out_frames = pcm->resample_buffer_frames;
+	hfpag_resample_process(pcm->resample, buffer, &in_frames,
+			pcm->resample_buffer, &out_frames);
+
+	/* The application frames have been consumed by now, so whatever
+	 * BlueALSA cannot take yet is kept for the next transfer. */
+	pcm->resample_pending = out_frames;
+	if ((ret = hfpag_pcm_resample_flush(pcm)) < 0)
+		return ret;
+
+	pcm->transferred += in_frames;
+	return in_frames;
+}
+
+static snd_pcm_sframes_t hfpag_pcm_resample_read(struct hfpag_pcm *pcm,
+		int16_t *buffer, snd_pcm_uframes_t size) {
+
+	/* Take from BlueALSA only as much as the resampler will consume, so
+	 * that nothing has to be kept for the next transfer. */
+	size_t in_frames = MIN(hfpag_resample_input_frames(pcm->resample, size),
+			pcm->resample_buffer_frames);
+
+	snd_pcm_sframes_t ret;
+	if (in_frames > 0) {
+		if ((ret = hfpag_pcm_ba_transfer(pcm, pcm->resample_buffer, in_frames)) < 0)
+			return ret;
+		in_frames = ret;
+	}
+
+	size_t out_frames = size;
+	hfpag_resample_process(pcm->resample, pcm->resample_buffer, &in_frames,
+			buffer, &out_frames);
+
+	pcm->transferred += out_frames;
+	return out_frames;
+}
+
+/**
+ * Transfer frames in the BlueALSA format at the application rate. */
+static snd_pcm_sframes_t hfpag_pcm_io_transfer(struct hfpag_pcm *pcm,
+		void *buffer, snd_pcm_uframes_t size) {
+
+	if (pcm->resample != NULL)
+		return pcm->io.stream == SND_PCM_STREAM_PLAYBACK ?
+			hfpag_pcm_resample_write(pcm, buffer, size) :
+			hfpag_pcm_resample_read(pcm, buffer, size);
+
+	snd_pcm_sframes_t frames;
+	if ((frames = hfpag_pcm_ba_transfer(pcm, buffer, size)) > 0)
+		pcm->transferred += frames;
+
+	return frames;
+}
+
+static snd_pcm_sframes_t hfpag_pcm_transfer(snd_pcm_ioplug_t *io,
+		const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset,
+		snd_pcm_uframes_t size) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	void *buffer = (uint8_t *)areas->addr + (areas->first + areas->step * offset) / 8;
+
+	if (pcm->convert == NULL)
+		return hfpag_pcm_io_transfer(pcm, buffer, size);
+
+	/* The application frames are converted in a single pass, a block at
+	 * a time, on their way to or from BlueALSA. */
+	int16_t block[HFPAG_PCM_CONVERT_FRAMES];
+	snd_pcm_uframes_t done = 0;
+	while (done < size) {
+
+		uint8_t *data = (uint8_t *)buffer + done * pcm->convert_frame_size;
+		const snd_pcm_uframes_t frames = MIN(size - done, ARRAYSIZE(block));
+		snd_pcm_sframes_t ret;
+
+		if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+			pcm->convert(block, data, frames);
+			ret = hfpag_pcm_io_transfer(pcm, block, frames);
+		}
+		else if ((ret = hfpag_pcm_io_transfer(pcm, block, frames)) > 0)
+			pcm->convert(data, block, ret);
+
+		if (ret < 0)
+			return done > 0 ? (snd_pcm_sframes_t)done : ret;
+		done += ret;
+		if ((snd_pcm_uframes_t)ret < frames)
+			break;
+
+	}
+
+	return done;
+}
+
+static int hfpag_pcm_close(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	if (pcm->async)
+		/* The worker takes over the session and our D-Bus reference. */
+		hfpag_worker_free(pcm->session, pcm->dbus_ctx);
+	else {
+		/* This also ends the session. */
+		hfpag_session_free(pcm->session);
+		hfpag_dbus_put(pcm->dbus_ctx);
+	}
+
+	if (pcm->sco != NULL)
+		hfpag_sco_free(pcm->sco);
+	if (pcm->resample != NULL)
+		hfpag_resample_free(pcm->resample);
+	free(pcm->resample_buffer);
+	close(pcm->fd_timer);
+	close(pcm->fd_ctrl);
+	close(pcm->fd);
+	free(pcm);
+	return 0;
+}
+
+/**
+ * Set up the SCO cadence adapter for the negotiated buffer size. Without a
+ * known cadence for the codec, audio goes to the pipe directly. */
+static int hfpag_pcm_sco_init(struct hfpag_pcm *pcm) {
+	snd_pcm_ioplug_t *io = &pcm->io;
+
+	if (pcm->sco != NULL) {
+		hfpag_sco_free(pcm->sco);
+		pcm->sco = NULL;
+	}
+
+	const struct hfpag_sco_codec *codec;
+	if ((codec = hfpag_sco_codec_get(pcm->ba_pcm.codec.name)) == NULL ||
+			codec->rate != pcm->ba_pcm.rate) {
+		SNDERR("Unknown SCO cadence for codec: %s", pcm->ba_pcm.codec.name);
+		return 0;
+	}
+
+	/* The ring works at the BlueALSA rate. */
+	const size_t ring_frames = (uint64_t)io->buffer_size * pcm->ba_pcm.rate / io->rate + 1;
+
+	if ((pcm->sco = hfpag_sco_new(pcm->fd, io->stream == SND_PCM_STREAM_PLAYBACK,
+					pcm->frame_size, codec->rate, codec->packet_frames,
+					ring_frames)) == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void hfpag_pcm_resample_free(struct hfpag_pcm *pcm) {
+	if (pcm->resample != NULL) {
+		hfpag_resample_free(pcm->resample);
+		pcm->resample = NULL;
+	}
+	free(pcm->resample_buffer);
+	pcm->resample_buffer = NULL;
+	pcm->resample_pending = 0;
+}
+
+/**
+ * Set up the resampler for the negotiated rate. The hw constraints allow
+ * only conversions which the resampler supports. */
+static int hfpag_pcm_resample_init(struct hfpag_pcm *pcm) {
+	snd_pcm_ioplug_t *io = &pcm->io;
+
+	hfpag_pcm_resample_free(pcm);
+	if (io->rate == pcm->ba_pcm.rate)
+		return 0;
+
+	const bool playback = io->stream == SND_PCM_STREAM_PLAYBACK;
+	if ((pcm->resample = hfpag_resample_new(
+					playback ? io->rate : pcm->ba_pcm.rate,
+					playback ? pcm->ba_pcm.rate : io->rate)) == NULL ||
+			(pcm->resample_buffer = malloc(pcm->pipe_size)) == NULL) {
+		hfpag_pcm_resample_free(pcm);
+		return -ENOMEM;
+	}
+
+	pcm->resample_buffer_frames = pcm->pipe_size / pcm->frame_size;
+	return 0;
+}
+
+/**
+ * Select the conversion for the negotiated format and channels. */
+static int hfpag_pcm_convert_init(struct hfpag_pcm *pcm) {
+	snd_pcm_ioplug_t *io = &pcm->io;
+
+	pcm->convert = NULL;
+	if (io->format == hfpag_pcm_get_format(pcm->ba_pcm.format) &&
+			io->channels == pcm->ba_pcm.channels)
+		return 0;
+
+	if ((pcm->convert = io->stream == SND_PCM_STREAM_PLAYBACK ?
+				hfpag_convert_from(io->format, io->channels) :
+				hfpag_convert_to(io->format, io->channels)) == NULL) {
+		SNDERR("Unsupported conversion: %s %u channels",
+				snd_pcm_format_name(io->format), io->channels);
+		return -EINVAL;
+	}
+
+	pcm->convert_frame_size = snd_pcm_format_physical_width(io->format) / 8 * io->channels;
+	return 0;
+}
+
+static int hfpag_pcm_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params) {
+	struct hfpag_pcm *pcm = io->private_data;
+	(void)params;
+	int ret;
+
+	if ((ret = hfpag_pcm_convert_init(pcm)) < 0)
+		return ret;
+
+	if ((ret = hfpag_pcm_resample_init(pcm)) < 0)
+		return ret;
+
+	if (pcm->cadence &&
+			(ret = hfpag_pcm_sco_init(pcm)) < 0)
+		return ret;
+
+	if (!pcm->session_started)
+		hfpag_pcm_session_begin(pcm);
+
+	return 0;
+}
+
+static int hfpag_pcm_hw_free(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+	if (pcm->sco != NULL) {
+		hfpag_sco_free(pcm->sco);
+		pcm->sco = NULL;
+	}
+	hfpag_pcm_resample_free(pcm);
+	hfpag_pcm_session_suspend(pcm);
+	return 0;
+}
+
+static int hfpag_pcm_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params) {
+	struct hfpag_pcm *pcm = io->private_data;
+	snd_pcm_sw_params_get_avail_min(params, &pcm->avail_min);
+	return 0;
+}
+
+static int hfpag_pcm_prepare(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	/* On the way from an xrun back to prepare ioplug does not call the
+	 * stop callback, so the I/O thread may still be running. */
+	if (pcm->sco != NULL)
+		hfpag_sco_stop(pcm->sco);
+
+	/* Make sure that BlueALSA does not hold any data of a previous run,
+	 * then discard what is left in the pipe. */
+	if (hfpag_pcm_ctrl(pcm, "Drop") < 0)
+		return -EIO;
+
+	if (io->stream == SND_PCM_STREAM_CAPTURE) {
+		uint8_t buffer[1024];
+		while (read(pcm->fd, buffer, sizeof(buffer)) > 0)
+			continue;
+	}
+
+	if (pcm->sco != NULL)
+		hfpag_sco_reset(pcm->sco);
+	if (pcm->resample != NULL) {
+		hfpag_resample_reset(pcm->resample);
+		pcm->resample_pending = 0;
+	}
+
+	/* Start counting from what is left in the pipe, should BlueALSA not
+	 * have consumed all of it, so that the position cannot go negative. */
+	snd_pcm_sframes_t queued = 0;
+	if (io->stream == SND_PCM_STREAM_PLAYBACK &&
+			(queued = hfpag_pcm_ba_queued(pcm)) < 0)
+		return queued;
+
+	pcm->ba_transferred = queued;
+	pcm->transferred = hfpag_pcm_frames_to_io(pcm, queued);
+	pcm->avail_min = MAX(pcm->avail_min, io->period_size);
+
+	/* The playback stream can be written right away, so the poll
+	 * descriptor has to report that before the stream is started. */
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		struct itimerspec ts = { .it_value.tv_nsec = 1 };
+		timerfd_settime(pcm->fd_timer, 0, &ts, NULL);
+	}
+	else
+		hfpag_pcm_timer_set(pcm, false);
+
+	return 0;
+}
+
+static int hfpag_pcm_drain(snd_pcm_ioplug_t *io) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	/* Wait for BlueALSA to read everything from the pipe. If it makes no
+	 * progress for a whole buffer time, the transport has stalled. This
+	 * counts BlueALSA frames, so that the input the resampler holds back
+	 * for its filter history is not waited for. */
+	snd_pcm_sframes_t queued, queued_prev = -1;
+	unsigned int stalled = 0;
+	while ((queued = hfpag_pcm_ba_queued(pcm)) >= 0 &&
+			(queued += pcm->resample_pending) > 0) {
+
+		if (io->nonblock)
+			return -EAGAIN;
+
+		snd_pcm_sframes_t ret;
+		if ((ret = hfpag_pcm_resample_flush(pcm)) < 0)
+			return ret;
+
+		if (queued == queued_prev &&
+				++stalled > io->buffer_size / io->period_size) {
+			SNDERR("BlueALSA PCM drain stalled");
+			return -EIO;
+		}
+		if (queued != queued_prev)
+			stalled = 0;
+		queued_prev = queued;
+
+		struct pollfd pfd = { pcm->fd_timer, POLLIN, 0 };
+		uint64_t expirations;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			return -errno;
+		if (read(pcm->fd_timer, &expirations, sizeof(expirations)) == -1 &&
+				errno != EAGAIN)
+			return -errno;
+
+	}
+
+	if (queued < 0)
+		return queued;
+
+	/* BlueALSA responds once its own buffer has been played. */
+	return hfpag_pcm_ctrl(pcm, "Drain");
+}
+
+static int hfpag_pcm_pause(snd_pcm_ioplug_t *io, int enable) {
+	struct hfpag_pcm *pcm = io->private_data;
+	int ret;
+	if ((ret = hfpag_pcm_ctrl(pcm, enable ? "Pause" : "Resume")) < 0)
+		return ret;
+	if (pcm->sco != NULL) {
+		if (enable)
+			hfpag_sco_stop(pcm->sco);
+		else if ((ret = hfpag_sco_start(pcm->sco)) < 0)
+			return ret;
+	}
+	return hfpag_pcm_timer_set(pcm, !enable);
+}
+
+static int hfpag_pcm_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd,
+		unsigned int nfds, unsigned short *revents) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	if (nfds != 1 || pfd[0].fd != pcm->fd_timer)
+		return -EINVAL;
+
+	*revents = 0;
+
+	if (pfd[0].revents & POLLIN) {
+		uint64_t expirations;
+		if (read(pcm->fd_timer, &expirations, sizeof(expirations)) == -1 &&
+				errno != EAGAIN)
+			return -errno;
+	}
+
+	/* Every frame written by the application goes straight into the pipe,
+	 * so what is queued there is all there is to play, or all there is
+	 * to read. */
+	snd_pcm_sframes_t queued;
+	if (hfpag_pcm_resample_flush(pcm) < 0 ||
+			(queued = hfpag_pcm_queued(pcm)) < 0) {
+		*revents = POLLERR;
+		return 0;
+	}
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK) {
+		if (io->buffer_size - MIN((snd_pcm_uframes_t)queued, io->buffer_size) >= pcm->avail_min)
+			*revents = POLLOUT;
+	}
+	else {
+		if ((snd_pcm_uframes_t)queued > io->buffer_size)
+			*revents = POLLERR;
+		else if ((snd_pcm_uframes_t)queued >= pcm->avail_min)
+			*revents = POLLIN;
+	}
+
+	return 0;
+}
+
+static int hfpag_pcm_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp) {
+	struct hfpag_pcm *pcm = io->private_data;
+
+	snd_pcm_sframes_t queued;
+	if ((queued = hfpag_pcm_queued(pcm)) < 0)
+		return queued;
+
+	/* BlueALSA reports its own delay in 1/10 of a millisecond. */
+	const snd_pcm_sframes_t ba_delay = (snd_pcm_sframes_t)pcm->ba_pcm.delay * io->rate / 10000;
+
+	*delayp = queued + ba_delay;
+	if (pcm->resample != NULL)
+		*delayp += hfpag_resample_delay(pcm->resample, io->rate);
+
+	return 0;
+}
+
+static const snd_pcm_ioplug_callback_t hfpag_pcm_callback = {
+	.start = hfpag_pcm_start,
+	.stop = hfpag_pcm_stop,
+	.pointer = hfpag_pcm_pointer,
+	.transfer = hfpag_pcm_transfer,
+	.close = hfpag_pcm_close,
+	.hw_params = hfpag_pcm_hw_params,
+	.hw_free = hfpag_pcm_hw_free,
+	.sw_params = hfpag_pcm_sw_params,
+	.prepare = hfpag_pcm_prepare,
+	.drain = hfpag_pcm_drain,
+	.pause = hfpag_pcm_pause,
+	.poll_revents = hfpag_pcm_poll_revents,
+	.delay = hfpag_pcm_delay,
+};
+
+static int hfpag_pcm_set_hw_constraints(struct hfpag_pcm *pcm) {
+	snd_pcm_ioplug_t *io = &pcm->io;
+	int ret;
+
+	static const unsigned int accesses[] = {
+		SND_PCM_ACCESS_MMAP_INTERLEAVED,
+		SND_PCM_ACCESS_RW_INTERLEAVED,
+	};
+
+	const unsigned int format = hfpag_pcm_get_format(pcm->ba_pcm.format);
+	if (format == (unsigned int)SND_PCM_FORMAT_UNKNOWN) {
+		SNDERR("Unsupported BlueALSA PCM format: %#x", pcm->ba_pcm.format);
+		return -EINVAL;
+	}
+
+	/* The plugin converts the common application formats to and from
+	 * S16 mono, which is what BlueALSA uses for all SCO codecs. */
+	const unsigned int formats[] = {
+		format,
+		SND_PCM_FORMAT_S32_LE,
+		SND_PCM_FORMAT_FLOAT_LE,
+	};
+	const bool convert = format == SND_PCM_FORMAT_S16_LE && pcm->ba_pcm.channels == 1;
+
+	unsigned int rate = pcm->ba_pcm.rate;
+	if (pcm->rate != 0 && pcm->rate != rate) {
+		const bool playback = io->stream == SND_PCM_STREAM_PLAYBACK;
+		if (format != SND_PCM_FORMAT_S16_LE || pcm->ba_pcm.channels != 1 ||
+				!hfpag_resample_supported(playback ? pcm->rate : rate,
+					playback ? rate : pcm->rate)) {
+			SNDERR("Unsupported resampling between %u Hz and %u Hz", rate, pcm->rate);
+			return -EINVAL;
+		}
+		rate = pcm->rate;
+	}
+
+	if ((ret = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
+					ARRAYSIZE(accesses), accesses)) < 0 ||
+			(ret = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_FORMAT,
+					convert ? ARRAYSIZE(formats) : 1, formats)) < 0 ||
+			(ret = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_CHANNELS,
+					convert ? 1 : pcm->ba_pcm.channels,
+					convert ? 2 : pcm->ba_pcm.channels)) < 0 ||
+			(ret = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
+					rate, rate)) < 0)
+		return ret;
+
+	/* Periods which are whole multiples of the SCO packet never leave
+	 * BlueALSA waiting for the rest of a packet. When resampling, that is
+	 * possible only if the packet is a whole number of frames at the
+	 * application rate. The sizes are in bytes of the application format,
+	 * which is not known yet, so they are counted in packets of the widest
+	 * format offered: in any narrower one a period is then a multiple of
+	 * two or four packets. */
+	const struct hfpag_sco_codec *codec;
+	unsigned int periods[HFPAG_PCM_PERIOD_SIZES];
+	size_t n = 0;
+	if ((codec = hfpag_sco_codec_get(pcm->ba_pcm.codec.name)) != NULL &&
+			codec->rate == pcm->ba_pcm.rate &&
+			codec->packet_frames * rate % codec->rate == 0) {
+
+		/* FLOAT_LE stereo */
+		const size_t frame_size = convert ? 2 * sizeof(float) : pcm->frame_size;
+		const size_t packet = codec->packet_frames * rate / codec->rate * frame_size;
+
+		/* The whole buffer has to fit into the pipe, see the transfer. */
+		for (n = 0; n < ARRAYSIZE(periods) && (n + 1) * packet <= pcm->pipe_size / 2; n++)
+			periods[n] = (n + 1) * packet;
+
+	}
+
+	if (n > 0) {
+		if ((ret = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+						n, periods)) < 0)
+			return ret;
+	}
+	else if ((ret = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					128, pcm->pipe_size / 2)) < 0)
+		return ret;
+
+	if ((ret = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+					256, pcm->pipe_size)) < 0 ||
+			(ret = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_PERIODS,
+					2, 1024)) < 0)
+		return ret;
+
+	return 0;
+}
+
+#pragma GCC visibility push(default)
+
+SND_PCM_PLUGIN_DEFINE_FUNC(bluealsa_hfpag) {
+	(void)root;
+
+	struct hfpag_config config;
+	hfpag_config_init(&config);
+	bool cadence = false;
+	long rate = 0;
+
+	snd_config_iterator_t i, next;
+	snd_config_for_each(i, next, conf) {
+		snd_config_t *node = snd_config_iterator_entry(i);
+		const char *id;
+		int ret;
+		if (snd_config_get_id(node, &id) < 0)
+			continue;
+		if (strcmp(id, "comment") == 0 ||
+				strcmp(id, "type") == 0 ||
+				strcmp(id, "hint") == 0)
+			continue;
+		if (strcmp(id, "cadence") == 0) {
+			int val;
+			if ((val = snd_config_get_bool(node)) < 0) {
+				SNDERR("Invalid value for %s", id);
+				return -EINVAL;
+			}
+			cadence = val;
+			continue;
+		}
+		if (strcmp(id, "rate") == 0) {
+			if (snd_config_get_integer(node, &rate) < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+			if (rate < 0 || rate > 192000) {
+				SNDERR("Invalid rate: %ld", rate);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if ((ret = hfpag_config_parse(&config, node, id)) < 0)
+			return ret;
+		if (ret > 0)
+			continue;
+		SNDERR("Unknown field %s", id);
+		return -EINVAL;
+	}
+
+	int ret;
+	bdaddr_t ba_addr;
+	if ((ret = hfpag_config_finish(&config, &ba_addr)) < 0)
+		return ret;
+
+	struct hfpag_pcm *pcm;
+	if ((pcm = calloc(1, sizeof(*pcm))) == NULL)
+		return -ENOMEM;
+
+	pcm->fd = -1;
+	pcm->fd_ctrl = -1;
+	pcm->fd_timer = -1;
+	pcm->ready = config.ready;
+	pcm->async = config.async;
+	pcm->cadence = cadence;
+	pcm->rate = rate;
+
+	/* Bound the total time spent in D-Bus calls while opening the PCM. */
+	if (config.timeout > 0)
+		ba_dbus_deadline_set(config.timeout);
+
+	DBusError err = DBUS_ERROR_INIT;
+
+	if ((pcm->dbus_ctx = hfpag_dbus_get(config.service, &err)) == NULL) {
+		SNDERR("Couldn't initialize D-Bus context: %s", err.message);
+		ret = -EIO;
+		goto fail;
+	}
+
+	const unsigned int ba_mode = stream == SND_PCM_STREAM_PLAYBACK ?
+		BA_PCM_MODE_SINK : BA_PCM_MODE_SOURCE;
+
+	/* Resolve the default device to the most recently connected one. */
+	if (bacmp(&ba_addr, BDADDR_ANY) == 0) {
+		if (!hfpag_dbus_pcm_get(pcm->dbus_ctx, &ba_addr, ba_mode, &pcm->ba_pcm, &err)) {
+			SNDERR("Couldn't get BlueALSA PCM: %s", err.message);
+			ret = -ENODEV;
+			goto fail;
+		}
+		bacpy(&ba_addr, &pcm->ba_pcm.addr);
+	}
+
+	struct hfpag_dbus_device ba_device;
+	if (!hfpag_dbus_device_get(pcm->dbus_ctx, &ba_addr, &ba_device, &err)) {
+		SNDERR("Couldn't get BlueALSA PCM: %s", err.message);
+		ret = -ENODEV;
+		goto fail;
+	}
+
+	memcpy(&pcm->ba_pcm, ba_mode == BA_PCM_MODE_SINK ?
+			&ba_device.sink : &ba_device.source, sizeof(pcm->ba_pcm));
+	if (!(pcm->ba_pcm.transport & BA_PCM_TRANSPORT_HFP_AG)) {
+		SNDERR("BlueALSA HFP-AG PCM not found: %s", config.device);
+		ret = -ENODEV;
+		goto fail;
+	}
+
+	if ((ret = hfpag_session_init(&pcm->session, pcm->dbus_ctx->ba_service,
+					ba_device.rfcomm_path, &pcm->ba_pcm.addr, config.lock, config.linger)) < 0) {
+		SNDERR("Cannot initialize HFP call session");
+		goto fail;
+	}
+
+	if (!ba_dbus_pcm_open(pcm->dbus_ctx, pcm->ba_pcm.pcm_path,
+				&pcm->fd, &pcm->fd_ctrl, &err)) {
+		SNDERR("Couldn't open BlueALSA PCM: %s", err.message);
+		ret = -dbus_error_to_errno(&err);
+		goto fail;
+	}
+
+	int pipe_size;
+	if ((pipe_size = fcntl(pcm->fd, F_GETPIPE_SZ)) == -1) {
+		ret = -errno;
+		SNDERR("Couldn't get BlueALSA PCM pipe size: %s", strerror(errno));
+		goto fail;
+	}
+
+	pcm->pipe_size = pipe_size;
+	pcm->frame_size = snd_pcm_format_physical_width(
+			hfpag_pcm_get_format(pcm->ba_pcm.format)) / 8 * pcm->ba_pcm.channels;
+
+	if (fcntl(pcm->fd, F_SETFL, O_NONBLOCK) == -1 ||
+			(pcm->fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		ret = -errno;
+		goto fail;
+	}
+
+	pcm->io.version = SND_PCM_IOPLUG_VERSION;
+	pcm->io.name = "BlueALSA HFP-AG";
+	pcm->io.flags = SND_PCM_IOPLUG_FLAG_LISTED | SND_PCM_IOPLUG_FLAG_MONOTONIC;
+	pcm->io.mmap_rw = 0;
+	pcm->io.poll_fd = pcm->fd_timer;
+	pcm->io.poll_events = POLLIN;
+	pcm->io.callback = &hfpag_pcm_callback;
+	pcm->io.private_data = pcm;
+
+	if ((ret = snd_pcm_ioplug_create(&pcm->io, name, stream, mode)) < 0)
+		goto fail;
+
+	if ((ret = hfpag_pcm_set_hw_constraints(pcm)) < 0) {
+		/* From now on the ioplug layer owns the PCM, and our close
+		 * callback releases everything. */
+		snd_pcm_ioplug_delete(&pcm->io);
+		ba_dbus_deadline_set(-1);
+		return ret;
+	}
+
+	/* Start the call now, so that the HF can set up the SCO link while the
+	 * application is still configuring the PCM. */
+	if (config.eager)
+		hfpag_pcm_session_begin(pcm);
+
+	ba_dbus_deadline_set(-1);
+	*pcmp = pcm->io.pcm;
+	return 0;
+
+fail:
+	ba_dbus_deadline_set(-1);
+	dbus_error_free(&err);
+	if (pcm->session != NULL)
+		hfpag_session_free(pcm->session);
+	if (pcm->dbus_ctx != NULL)
+		hfpag_dbus_put(pcm->dbus_ctx);
+	if (pcm->fd_timer != -1)
+		close(pcm->fd_timer);
+	if (pcm->fd_ctrl != -1)
+		close(pcm->fd_ctrl);
+	if (pcm->fd != -1)
+		close(pcm->fd);
+	free(pcm);
+	return ret;
+}
+
+SND_PCM_PLUGIN_SYMBOL(bluealsa_hfpag);
+
+#pragma GCC visibility pop
@@ -0,0 +1,322 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-resample.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+# define HFPAG_RESAMPLE_X86 1
+# include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
+#include "hfpag-resample.h"
+#include "bluez-alsa/defs.h"
+
+/* Kaiser window shape parameter, about 90 dB of stop-band attenuation */
+#define HFPAG_RESAMPLE_KAISER_BETA 8.6
+/* cut-off frequency relative to the lower of the two rates */
+#define HFPAG_RESAMPLE_CUTOFF 0.45
+
+/**
+ * Rational conversion ratio, the input is up-sampled by a factor of L,
+ * low-pass filtered and then down-sampled by a factor of M. */
+struct hfpag_resample_ratio {
+	unsigned int in_rate;
+	unsigned int out_rate;
+	unsigned int L;
+	unsigned int M;
+	/* filter length of each polyphase branch, a multiple of 8 so that all
+	 * kernels work on whole vectors */
+	unsigned int taps;
+};
+
+/* Conversions between the SCO link rates and the common application rates.
+ * When down-sampling the branches are longer, so that the transition band
+ * is as narrow relative to the output rate as it is for up-sampling. */
+static const struct hfpag_resample_ratio hfpag_resample_ratios[] = {
+	{ 8000, 48000, 6, 1, 64 },
+	{ 16000, 48000, 3, 1, 64 },
+	{ 32000, 48000, 3, 2, 64 },
+	{ 8000, 44100, 441, 80, 64 },
+	{ 16000, 44100, 441, 160, 64 },
+	{ 32000, 44100, 441, 320, 64 },
+	{ 48000, 8000, 1, 6, 384 },
+	{ 48000, 16000, 1, 3, 192 },
+	{ 48000, 32000, 2, 3, 96 },
+	{ 44100, 8000, 80, 441, 360 },
+	{ 44100, 16000, 160, 441, 184 },
+	{ 44100, 32000, 320, 441, 96 },
+};
+
+/**
+ * Polyphase sample rate converter for mono S16 audio. */
+struct hfpag_resample {
+	const struct hfpag_resample_ratio *ratio;
+	/* polyphase branches, each one ordered from the oldest sample */
+	float *coefs;
+	/* the last taps samples, stored twice, so that the filter window is
+	 * always contiguous */
+	float *history;
+	unsigned int pos;
+	/* position of the next output sample within the current input sample,
+	 * in up-sampled steps; the next input is needed when it reaches L */
+	unsigned int phase;
+};
+
+typedef float (*hfpag_resample_dot_t)(const float *a, const float *b, unsigned int n);
+
+static float hfpag_resample_dot_scalar(const float *a, const float *b, unsigned int n) {
+	float sum[4] = { 0 };
+	for (unsigned int i = 0; i < n; i += 4) {
+		sum[0] += a[i + 0] * b[i + 0];
+		sum[1] += a[i + 1] * b[i + 1];
+		sum[2] += a[i + 2] * b[i + 2];
+		sum[3] += a[i + 3] * b[i + 3];
+	}
+	return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+#if HFPAG_RESAMPLE_X86
+
+static float hfpag_resample_dot_sse2(const float *a, const float *b, unsigned int n) {
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	for (unsigned int i = 0; i < n; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	__m128 sum = _mm_add_ps(sum0, sum1);
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+__attribute__ ((target("avx2")))
+static float hfpag_resample_dot_avx2(const float *a, const float *b, unsigned int n) {
+	__m256 sum = _mm256_setzero_ps();
+	for (unsigned int i = 0; i < n; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	__m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	sum4 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+	sum4 = _mm_add_ss(sum4, _mm_shuffle_ps(sum4, sum4, 1));
+	return _mm_cvtss_f32(sum4);
+}
+
+#endif
+
+#if defined(__ARM_NEON)
+
+static float hfpag_resample_dot_neon(const float *a, const float *b, unsigned int n) {
+	float32x4_t sum0 = vdupq_n_f32(0);
+	float32x4_t sum1 = vdupq_n_f32(0);
+	for (unsigned int i = 0; i < n; i += 8) {
+		sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+		sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+	}
+	const float32x4_t sum = vaddq_f32(sum0, sum1);
+# if defined(__aarch64__)
+	return vaddvq_f32(sum);
+# else
+	const float32x2_t sum2 = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+	return vget_lane_f32(vpadd_f32(sum2, sum2), 0);
+# endif
+}
+
+#endif
+
+static hfpag_resample_dot_t hfpag_resample_dot = hfpag_resample_dot_scalar;
+static pthread_once_t hfpag_resample_dot_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Select the fastest filter kernel supported by the CPU. */
+static void hfpag_resample_dot_init(void) {
+#if HFPAG_RESAMPLE_X86
+	hfpag_resample_dot = hfpag_resample_dot_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		hfpag_resample_dot = hfpag_resample_dot_avx2;
+#elif defined(__ARM_NEON)
+	hfpag_resample_dot = hfpag_resample_dot_neon;
+#endif
+}
+
+static const struct hfpag_resample_ratio *hfpag_resample_ratio_get(
+		unsigned int in_rate, unsigned int out_rate) {
+	for (size_t i = 0; i < ARRAYSIZE(hfpag_resample_ratios); i++)
+		if (hfpag_resample_ratios[i].in_rate == in_rate &&
+				hfpag_resample_ratios[i].out_rate == out_rate)
+			return &hfpag_resample_ratios[i];
+	return NULL;
+}
+
+bool hfpag_resample_supported(unsigned int in_rate, unsigned int out_rate) {
+	return hfpag_resample_ratio_get(in_rate, out_rate) != NULL;
+}
+
+/**
+ * Zeroth order modified Bessel function of the first kind. */
+static double hfpag_resample_bessel_i0(double x) {
+	double sum = 1, term = 1;
+	for (unsigned int k = 1; term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/**
+ * Design the Kaiser windowed sinc low-pass prototype filter at the
+ * up-sampled rate and split it into the polyphase branches. */
+static void hfpag_resample_design(const struct hfpag_resample_ratio *ratio, float *coefs) {
+
+	const unsigned int L = ratio->L;
+	const unsigned int taps = ratio->taps;
+	const unsigned int len = L * taps;
+
+	/* cut-off frequency in cycles per up-sampled sample */
+	const double fc = HFPAG_RESAMPLE_CUTOFF *
+		MIN(ratio->in_rate, ratio->out_rate) / ((double)L * ratio->in_rate);
+	const double center = (len - 1) / 2.0;
+	const double i0_beta = hfpag_resample_bessel_i0(HFPAG_RESAMPLE_KAISER_BETA);
+
+	double sum = 0;
+	for (unsigned int m = 0; m < len; m++) {
+
+		const double t = m - center;
+		const double sinc = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+		const double r = t / (center + 1);
+		const double window = hfpag_resample_bessel_i0(
+				HFPAG_RESAMPLE_KAISER_BETA * sqrt(1 - r * r)) / i0_beta;
+
+		const double h = sinc * window;
+		sum += h;
+
+		/* The tap m belongs to the branch m % L, where it weights the
+		 * sample m / L positions back from the newest one. */
+		const unsigned int p = m % L;
+		coefs[p * taps + (taps - 1 - m / L)] = h;
+
+	}
+
+	/* Every branch has to have unity gain at DC, so the prototype as
+	 * a whole has a gain of L. */
+	for (unsigned int m = 0; m < len; m++)
+		coefs[m] *= L / sum;
+
+}
+
+/**
+ * Create a sample rate converter for the given rates. Returns NULL if the
+ * conversion is not supported or on allocation failure. */
+struct hfpag_resample *hfpag_resample_new(unsigned int in_rate, unsigned int out_rate) {
+
+	const struct hfpag_resample_ratio *ratio;
+	if ((ratio = hfpag_resample_ratio_get(in_rate, out_rate)) == NULL)
+		return NULL;
+
+	pthread_once(&hfpag_resample_dot_once, hfpag_resample_dot_init);
+
+	struct hfpag_resample *rs;
+	if ((rs = calloc(1, sizeof(*rs))) == NULL)
+		return NULL;
+
+	rs->ratio = ratio;
+
+	if ((rs->coefs = aligned_alloc(32, ratio->L * ratio->taps * sizeof(*rs->coefs))) == NULL ||
+			(rs->history = aligned_alloc(32, 2 * ratio->taps * sizeof(*rs->history))) == NULL) {
+		hfpag_resample_free(rs);
+		return NULL;
+	}
+
+	hfpag_resample_design(ratio, rs->coefs);
+	hfpag_resample_reset(rs);
+
+	return rs;
+}
+
+void hfpag_resample_free(struct hfpag_resample *rs) {
+	free(rs->history);
+	free(rs->coefs);
+	free(rs);
+}
+
+/**
+ * Reset the converter to silence. */
+void hfpag_resample_reset(struct hfpag_resample *rs) {
+	memset(rs->history, 0, 2 * rs->ratio->taps * sizeof(*rs->history));
+	rs->pos = 0;
+	rs->phase = 0;
+}
+
+static inline int16_t hfpag_resample_quantise(float sample) {
+	if (sample >= INT16_MAX)
+		return INT16_MAX;
+	if (sample <= INT16_MIN)
+		return INT16_MIN;
+	return lrintf(sample);
+}
+
+/**
+ * Convert audio.
+ *
+ * The conversion stops when either all input frames have been consumed, or
+ * the output buffer is full. On return in_frames and out_frames are set to
+ * the number of frames consumed and produced respectively. */
+void hfpag_resample_process(struct hfpag_resample *rs,
+		const int16_t *in, size_t *in_frames, int16_t *out, size_t *out_frames) {
+
+	const hfpag_resample_dot_t dot = hfpag_resample_dot;
+	const unsigned int L = rs->ratio->L;
+	const unsigned int M = rs->ratio->M;
+	const unsigned int taps = rs->ratio->taps;
+
+	size_t i = 0, o = 0;
+	while (o < *out_frames) {
+
+		if (rs->phase >= L) {
+			if (i == *in_frames)
+				break;
+			rs->history[rs->pos] = rs->history[rs->pos + taps] = in[i++];
+			if (++rs->pos == taps)
+				rs->pos = 0;
+			rs->phase -= L;
+			continue;
+		}
+
+		out[o++] = hfpag_resample_quantise(dot(
+					rs->coefs + rs->phase * taps, rs->history + rs->pos, taps));
+		rs->phase += M;
+
+	}
+
+	*in_frames = i;
+	*out_frames = o;
+}
+
+/**
+ * Get the number of input frames needed to produce exactly the given
+ * number of output frames. */
+size_t hfpag_resample_input_frames(const struct hfpag_resample *rs, size_t out_frames) {
+	if (out_frames == 0)
+		return 0;
+	return (rs->phase + (out_frames - 1) * rs->ratio->M) / rs->ratio->L;
+}
+
+/**
+ * Get the delay of the filter in frames at the given rate. */
+unsigned int hfpag_resample_delay(const struct hfpag_resample *rs, unsigned int rate) {
+	const struct hfpag_resample_ratio *ratio = rs->ratio;
+	return (uint64_t)(ratio->L * ratio->taps - 1) * rate /
+		(2 * (uint64_t)ratio->L * ratio->in_rate);
+}
@@ -0,0 +1,28 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-resample.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_RESAMPLE_H_
+#define HFPAG_RESAMPLE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct hfpag_resample;
+
+bool hfpag_resample_supported(unsigned int in_rate, unsigned int out_rate);
+
+struct hfpag_resample *hfpag_resample_new(unsigned int in_rate, unsigned int out_rate);
+void hfpag_resample_free(struct hfpag_resample *rs);
+void hfpag_resample_reset(struct hfpag_resample *rs);
+
+void hfpag_resample_process(struct hfpag_resample *rs,
+		const int16_t *in, size_t *in_frames, int16_t *out, size_t *out_frames);
+size_t hfpag_resample_input_frames(const struct hfpag_resample *rs, size_t out_frames);
+unsigned int hfpag_resample_delay(const struct hfpag_resample *rs, unsigned int rate);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-rfcomm.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-rfcomm.h"
+#include "bluez-alsa/dbus-client-rfcomm.h"
+#include "bluez-alsa/defs.h"
+
+/* Maximum time in milliseconds allowed for writing a sequence. */
+#define HFPAG_RFCOMM_TIMEOUT 1000
+
+/**
+ * Unsolicited result code, with its length calculated at compile time. */
+#define HFPAG_RFCOMM_CMD(s) { .iov_base = MUTABLE(s), .iov_len = sizeof(s) - 1 }
+
+static const struct iovec hfpag_transfer_call[] = {
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:1,1\r\n"),
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:5,5\r\n"),
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:2,1\r\n"),
+};
+
+static const struct iovec hfpag_terminate_call[] = {
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:2,0\r\n"),
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:5,0\r\n"),
+	HFPAG_RFCOMM_CMD("\r\n+CIEV:1,0\r\n"),
+};
+
+static long timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) * 1000000 + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void hfpag_rfcomm_reply(struct hfpag_rfcomm *rfcomm, const char *reply) {
+	/* best effort, the HF will time out the command if this fails */
+	send(rfcomm->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/**
+ * Handle a line received from the HF. BlueALSA forwards to us any AT command
+ * that it does not handle itself. We answer only the commands which concern
+ * the call we pretend to have, anything else is none of our business and is
+ * silently consumed. */
+static void hfpag_rfcomm_handle_line(struct hfpag_rfcomm *rfcomm, const char *line) {
+
+	if (strncasecmp(line, "AT+CLCC", 7) == 0) {
+		if (rfcomm->call_active)
+			hfpag_rfcomm_reply(rfcomm, "\r\n+CLCC:1,1,0,0,0\r\n\r\nOK\r\n");
+		else
+			hfpag_rfcomm_reply(rfcomm, "\r\nOK\r\n");
+	}
+
+}
+
+/**
+ * Read and process everything the HF has sent us so far, so that the socket
+ * buffer never fills up. */
+static void hfpag_rfcomm_drain(struct hfpag_rfcomm *rfcomm) {
+
+	for (;;) {
+
+		char *buffer = rfcomm->buffer;
+		ssize_t len;
+
+		if ((len = recv(rfcomm->fd, &buffer[rfcomm->buffer_len],
+						sizeof(rfcomm->buffer) - rfcomm->buffer_len - 1, MSG_DONTWAIT)) <= 0)
+			return;
+
+		rfcomm->buffer_len += len;
+		buffer[rfcomm->buffer_len] = '\0';
+
+		char *line = buffer;
+		char *eol;
+		while ((eol = strpbrk(line, "\r\n")) != NULL) {
+			*eol = '\0';
+			if (eol != line)
+				hfpag_rfcomm_handle_line(rfcomm, line);
+			line = eol + 1;
+		}
+
+		rfcomm->buffer_len = strlen(line);
+		if (rfcomm->buffer_len == sizeof(rfcomm->buffer) - 1)
+			/* Line too long, this is not something we can handle. */
+			rfcomm->buffer_len = 0;
+		memmove(buffer, line, rfcomm->buffer_len);
+
+	}
+
+}
+
+/**
+ * Get the RFCOMM socket, opening it if necessary. A socket which has been
+ * hung up by the BlueALSA service is transparently replaced. */
+static int hfpag_rfcomm_get(struct hfpag_rfcomm *rfcomm, struct ba_dbus_ctx *dbus_ctx) {
+
+	if (rfcomm->fd != -1) {
+		struct pollfd pfd = { rfcomm->fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 0) == 0)
+			return 0;
+		if (!(pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+			hfpag_rfcomm_drain(rfcomm);
+			return 0;
+		}
+		hfpag_rfcomm_close(rfcomm);
+	}
+
+	DBusError err = DBUS_ERROR_INIT;
+	if (!ba_dbus_rfcomm_open(dbus_ctx, rfcomm->path, &rfcomm->fd, &err)) {
+		SNDERR("Couldn't open RFCOMM: %s", err.message);
+		dbus_error_free(&err);
+		rfcomm->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the whole sequence with as few system calls as possible, without
+ * blocking for longer than the given timeout. Returns the number of bytes
+ * written, or -1 on error. */
+static ssize_t hfpag_rfcomm_write(struct hfpag_rfcomm *rfcomm,
+		const struct iovec *sequence, size_t count, int timeout) {
+
+	struct iovec iov[8];
+	size_t iovcnt = MIN(count, ARRAYSIZE(iov));
+	memcpy(iov, sequence, iovcnt * sizeof(*iov));
+
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+	ssize_t total = 0;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (msg.msg_iovlen > 0) {
+
+		ssize_t len;
+		if ((len = sendmsg(rfcomm->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1) {
+
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return total > 0 ? total : -1;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			long remaining = timeout - timespec_diff_us(&now, &start) / 1000;
+			if (remaining <= 0) {
+				errno = ETIMEDOUT;
+				return total > 0 ? total : -1;
+			}
+
+			/* The HF may be waiting for us to answer its commands before it
+			 * reads any more of ours. */
+			struct pollfd pfd = { rfcomm->fd, POLLOUT | POLLIN, 0 };
+			if (poll(&pfd, 1, remaining) > 0 && pfd.revents & POLLIN)
+				hfpag_rfcomm_drain(rfcomm);
+			continue;
+		}
+
+		total += len;
+		while (msg.msg_iovlen > 0 && (size_t)len >= msg.msg_iov->iov_len) {
+			len -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + len;
+			msg.msg_iov->iov_len -= len;
+		}
+
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rfcomm->write_time = timespec_diff_us(&now, &start);
+	if (rfcomm->write_time > rfcomm->write_time_max)
+		rfcomm->write_time_max = rfcomm->write_time;
+
+	return total;
+}
+
+static int hfpag_rfcomm_send_sequence(struct hfpag_rfcomm *rfcomm,
+		struct ba_dbus_ctx *dbus_ctx, const struct iovec *sequence, size_t count) {
+
+	/* If the connection has been lost since our last check, then the very
+	 * first write fails. In that case re-open the socket and try again. */
+	for (int retry = 1; retry >= 0; retry--) {
+
+		if (hfpag_rfcomm_get(rfcomm, dbus_ctx) == -1)
+			return -1;
+
+		ssize_t len = hfpag_rfcomm_write(rfcomm, sequence, count, HFPAG_RFCOMM_TIMEOUT);
+		int err = errno;
+
+		hfpag_rfcomm_drain(rfcomm);
+
+		if (len != -1) {
+			size_t expected = 0;
+			for (size_t i = 0; i < count; i++)
+				expected += sequence[i].iov_len;
+			if ((size_t)len == expected)
+				return 0;
+		}
+
+		hfpag_rfcomm_close(rfcomm);
+		if (len > 0 || retry == 0 ||
+				(err != EPIPE && err != ECONNRESET && err != ENOTCONN)) {
+			SNDERR("Couldn't complete RFCOMM sequence: %s", strerror(err));
+			return -1;
+		}
+
+	}
+
+	return -1;
+}
+
+void hfpag_rfcomm_init(struct hfpag_rfcomm *rfcomm, const char *path) {
+	memset(rfcomm, 0, sizeof(*rfcomm));
+	strncpy(rfcomm->path, path, sizeof(rfcomm->path) - 1);
+	rfcomm->fd = -1;
+}
+
+/**
+ * Get the time in microseconds taken to write the last complete sequence,
+ * and optionally the longest time taken so far. */
+unsigned int hfpag_rfcomm_write_time(const struct hfpag_rfcomm *rfcomm,
+		unsigned int *max) {
+	if (max != NULL)
+		*max = rfcomm->write_time_max;
+	return rfcomm->write_time;
+}
+
+/**
+ * Tell the HF that an outgoing call has been transferred to it. */
+int hfpag_rfcomm_transfer_call(struct hfpag_rfcomm *rfcomm, struct ba_dbus_ctx *dbus_ctx) {
+	rfcomm->call_active = true;
+	return hfpag_rfcomm_send_sequence(rfcomm, dbus_ctx,
+			hfpag_transfer_call, ARRAYSIZE(hfpag_transfer_call));
+}
+
+/**
+ * Tell the HF that the call has ended. */
+int hfpag_rfcomm_terminate_call(struct hfpag_rfcomm *rfcomm, struct ba_dbus_ctx *dbus_ctx) {
+	rfcomm->call_active = false;
+	return hfpag_rfcomm_send_sequence(rfcomm, dbus_ctx,
+			hfpag_terminate_call, ARRAYSIZE(hfpag_terminate_call));
+}
+
+/**
+ * Process any data received from the HF. Returns -1 if the connection has
+ * been closed by the BlueALSA service. */
+int hfpag_rfcomm_dispatch(struct hfpag_rfcomm *rfcomm) {
+
+	if (rfcomm->fd == -1)
+		return -1;
+
+	char c;
+	ssize_t len;
+	if ((len = recv(rfcomm->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT)) == 0 ||
+			(len == -1 && errno != EAGAIN && errno != EINTR))
+		return -1;
+
+	hfpag_rfcomm_drain(rfcomm);
+	return 0;
+}
+
+void hfpag_rfcomm_close(struct hfpag_rfcomm *rfcomm) {
+	if (rfcomm->fd != -1) {
+		close(rfcomm->fd);
+		rfcomm->fd = -1;
+	}
+	rfcomm->buffer_len = 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-rfcomm.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_RFCOMM_H_
+#define HFPAG_RFCOMM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bluez-alsa/dbus-client.h"
+
+struct hfpag_rfcomm {
+	/* BlueALSA RFCOMM D-Bus path */
+	char path[128];
+	/* RFCOMM socket, -1 if not open */
+	int fd;
+	/* the HF has been told that a call is active */
+	bool call_active;
+	/* incomplete line received from the HF */
+	char buffer[256];
+	size_t buffer_len;
+	/* time in microseconds taken to write the last sequence, and the
+	 * longest time taken so far */
+	unsigned int write_time;
+	unsigned int write_time_max;
+};
+
+void hfpag_rfcomm_init(struct hfpag_rfcomm *rfcomm, const char *path);
+int hfpag_rfcomm_transfer_call(struct hfpag_rfcomm *rfcomm, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_rfcomm_terminate_call(struct hfpag_rfcomm *rfcomm, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_rfcomm_dispatch(struct hfpag_rfcomm *rfcomm);
+unsigned int hfpag_rfcomm_write_time(const struct hfpag_rfcomm *rfcomm,
+		unsigned int *max);
+void hfpag_rfcomm_close(struct hfpag_rfcomm *rfcomm);
+
+#endif
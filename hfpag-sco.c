@@ -0,0 +1,303 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-sco.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-sco.h"
+#include "bluez-alsa/defs.h"
+
+/* number of packets kept in the BlueALSA PCM pipe during playback */
+#define HFPAG_SCO_PIPE_PACKETS 2
+
+static const struct hfpag_sco_codec hfpag_sco_codecs[] = {
+	/* 3.75 ms */
+	{ "CVSD", 8000, 30 },
+	/* 7.5 ms */
+	{ "mSBC", 16000, 120 },
+	/* 7.5 ms */
+	{ "LC3-SWB", 32000, 240 },
+};
+
+/**
+ * SCO cadence adapter.
+ *
+ * The application side and the I/O thread share a single-producer single-
+ * consumer ring buffer. The I/O thread moves audio between the ring and the
+ * BlueALSA PCM pipe one packet interval at a time, so BlueALSA sees the
+ * cadence of the SCO link whatever the application period size is. */
+struct hfpag_sco {
+	int fd;
+	bool playback;
+	size_t frame_size;
+	unsigned int packet_frames;
+	/* packet interval in nanoseconds */
+	uint64_t interval;
+
+	/* ring buffer, its size in bytes is a power of two */
+	uint8_t *ring;
+	size_t ring_size;
+	/* running byte counters, the ring positions are taken modulo size */
+	atomic_size_t head;
+	atomic_size_t tail;
+	/* captured audio had to be dropped because the ring was full */
+	atomic_bool overrun;
+	/* beginning of a captured frame whose rest is not in the pipe yet,
+	 * owned by the I/O thread */
+	uint8_t partial[16];
+	size_t partial_len;
+
+	pthread_t tid;
+	bool running;
+	atomic_bool quit;
+};
+
+const struct hfpag_sco_codec *hfpag_sco_codec_get(const char *name) {
+	for (size_t i = 0; i < ARRAYSIZE(hfpag_sco_codecs); i++)
+		if (strcasecmp(hfpag_sco_codecs[i].name, name) == 0)
+			return &hfpag_sco_codecs[i];
+	return NULL;
+}
+
+/**
+ * Copy data into the ring. Must be called by the producer only. */
+static size_t hfpag_sco_ring_put(struct hfpag_sco *sco, const void *data, size_t len) {
+
+	const size_t head = atomic_load_explicit(&sco->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&sco->tail, memory_order_acquire);
+
+	len = MIN(len, sco->ring_size - (head - tail));
+	len -= len % sco->frame_size;
+
+	const size_t pos = head & (sco->ring_size - 1);
+	const size_t n = MIN(len, sco->ring_size - pos);
+	memcpy(sco->ring + pos, data, n);
+	memcpy(sco->ring, (const uint8_t *)data + n, len - n);
+
+	atomic_store_explicit(&sco->head, head + len, memory_order_release);
+	return len;
+}
+
+/**
+ * Copy data out of the ring. Must be called by the consumer only. */
+static size_t hfpag_sco_ring_get(struct hfpag_sco *sco, void *data, size_t len) {
+
+	const size_t tail = atomic_load_explicit(&sco->tail, memory_order_relaxed);
+	const size_t head = atomic_load_explicit(&sco->head, memory_order_acquire);
+
+	len = MIN(len, head - tail);
+	len -= len % sco->frame_size;
+
+	const size_t pos = tail & (sco->ring_size - 1);
+	const size_t n = MIN(len, sco->ring_size - pos);
+	memcpy(data, sco->ring + pos, n);
+	memcpy((uint8_t *)data + n, sco->ring, len - n);
+
+	atomic_store_explicit(&sco->tail, tail + len, memory_order_release);
+	return len;
+}
+
+static size_t hfpag_sco_pipe_queued(struct hfpag_sco *sco) {
+	int size;
+	if (ioctl(sco->fd, FIONREAD, &size) == -1)
+		return 0;
+	return size;
+}
+
+/**
+ * Move one packet interval worth of audio between the ring and the pipe. */
+static void hfpag_sco_transfer(struct hfpag_sco *sco) {
+
+	const size_t packet = sco->packet_frames * sco->frame_size;
+	uint8_t buffer[HFPAG_SCO_PIPE_PACKETS * packet];
+	ssize_t len;
+
+	if (sco->playback) {
+
+		/* Keep the pipe topped up to a fixed number of packets, so that
+		 * BlueALSA never waits for data, and a drift between our clock and
+		 * the link clock does not build up latency. */
+		const size_t queued = hfpag_sco_pipe_queued(sco);
+		if (queued >= sizeof(buffer))
+			return;
+
+		/* The pipe has room for this, so the write is never partial. */
+		if ((len = hfpag_sco_ring_get(sco, buffer, sizeof(buffer) - queued)) > 0)
+			while (write(sco->fd, buffer, len) == -1 && errno == EINTR)
+				continue;
+
+	}
+	else {
+
+		/* Take everything BlueALSA has delivered so far. A frame split
+		 * across reads is kept until its rest arrives, possibly in the
+		 * next interval, so that the ring only ever holds whole frames. */
+		size_t partial = sco->partial_len;
+		memcpy(buffer, sco->partial, partial);
+		while ((len = read(sco->fd, buffer + partial, sizeof(buffer) - partial)) > 0 ||
+				(len == -1 && errno == EINTR)) {
+			if (len == -1)
+				continue;
+			const size_t size = partial + len;
+			partial = size % sco->frame_size;
+			if (hfpag_sco_ring_put(sco, buffer, size - partial) < size - partial)
+				atomic_store_explicit(&sco->overrun, true, memory_order_relaxed);
+			memmove(buffer, buffer + size - partial, partial);
+		}
+		memcpy(sco->partial, buffer, partial);
+		sco->partial_len = partial;
+
+	}
+
+}
+
+static void *hfpag_sco_thread(void *arg) {
+	struct hfpag_sco *sco = arg;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	while (!atomic_load_explicit(&sco->quit, memory_order_relaxed)) {
+
+		hfpag_sco_transfer(sco);
+
+		uint64_t ns = ts.tv_nsec + sco->interval;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+
+		/* Do not try to catch up after a long stall, otherwise we would
+		 * flood BlueALSA with a burst of packets. */
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - ts.tv_sec) * 1000000000 + (now.tv_nsec - ts.tv_nsec) >
+				(int64_t)(4 * sco->interval))
+			ts = now;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			continue;
+
+	}
+
+	return NULL;
+}
+
+/**
+ * Create SCO cadence adapter for the given BlueALSA PCM pipe. The ring holds
+ * at least the given number of frames. */
+struct hfpag_sco *hfpag_sco_new(int fd, bool playback, size_t frame_size,
+		unsigned int rate, unsigned int packet_frames, size_t ring_frames) {
+
+	struct hfpag_sco *sco;
+	if (frame_size > sizeof(sco->partial))
+		return NULL;
+	if ((sco = calloc(1, sizeof(*sco))) == NULL)
+		return NULL;
+
+	sco->fd = fd;
+	sco->playback = playback;
+	sco->frame_size = frame_size;
+	sco->packet_frames = packet_frames;
+	sco->interval = (uint64_t)packet_frames * 1000000000 / rate;
+
+	sco->ring_size = 1;
+	while (sco->ring_size < ring_frames * frame_size)
+		sco->ring_size <<= 1;
+
+	if ((sco->ring = malloc(sco->ring_size)) == NULL) {
+		free(sco);
+		return NULL;
+	}
+
+	atomic_init(&sco->head, 0);
+	atomic_init(&sco->tail, 0);
+	atomic_init(&sco->overrun, false);
+	atomic_init(&sco->quit, false);
+
+	return sco;
+}
+
+void hfpag_sco_free(struct hfpag_sco *sco) {
+	hfpag_sco_stop(sco);
+	free(sco->ring);
+	free(sco);
+}
+
+/**
+ * Start the I/O thread. */
+int hfpag_sco_start(struct hfpag_sco *sco) {
+
+	if (sco->running)
+		return 0;
+
+	atomic_store(&sco->quit, false);
+
+	/* Signals must be handled by the application threads. */
+	sigset_t sigset, oldset;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	int err = pthread_create(&sco->tid, NULL, hfpag_sco_thread, sco);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (err != 0)
+		return -err;
+
+	sco->running = true;
+	return 0;
+}
+
+/**
+ * Stop the I/O thread. It takes at most one packet interval. */
+void hfpag_sco_stop(struct hfpag_sco *sco) {
+	if (!sco->running)
+		return;
+	atomic_store(&sco->quit, true);
+	pthread_join(sco->tid, NULL);
+	sco->running = false;
+}
+
+/**
+ * Discard the content of the ring. The I/O thread must not be running. */
+void hfpag_sco_reset(struct hfpag_sco *sco) {
+	atomic_store(&sco->head, 0);
+	atomic_store(&sco->tail, 0);
+	atomic_store(&sco->overrun, false);
+	sco->partial_len = 0;
+}
+
+/**
+ * Queue audio for playback. Returns the number of frames queued. */
+size_t hfpag_sco_write(struct hfpag_sco *sco, const void *data, size_t frames) {
+	return hfpag_sco_ring_put(sco, data, frames * sco->frame_size) / sco->frame_size;
+}
+
+/**
+ * Take captured audio. Returns the number of frames taken. */
+size_t hfpag_sco_read(struct hfpag_sco *sco, void *data, size_t frames) {
+	return hfpag_sco_ring_get(sco, data, frames * sco->frame_size) / sco->frame_size;
+}
+
+/**
+ * Get the number of frames in the ring. */
+size_t hfpag_sco_queued(struct hfpag_sco *sco) {
+	const size_t tail = atomic_load_explicit(&sco->tail, memory_order_acquire);
+	const size_t head = atomic_load_explicit(&sco->head, memory_order_acquire);
+	return (head - tail) / sco->frame_size;
+}
+
+bool hfpag_sco_overrun(struct hfpag_sco *sco) {
+	return atomic_load_explicit(&sco->overrun, memory_order_relaxed);
+}
@@ -0,0 +1,41 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-sco.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_SCO_H_
+#define HFPAG_SCO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The audio cadence of an SCO codec. */
+struct hfpag_sco_codec {
+	/* BlueALSA codec name */
+	const char *name;
+	unsigned int rate;
+	/* frames carried by the link in one packet interval */
+	unsigned int packet_frames;
+};
+
+const struct hfpag_sco_codec *hfpag_sco_codec_get(const char *name);
+
+struct hfpag_sco;
+
+struct hfpag_sco *hfpag_sco_new(int fd, bool playback, size_t frame_size,
+		unsigned int rate, unsigned int packet_frames, size_t ring_frames);
+void hfpag_sco_free(struct hfpag_sco *sco);
+
+int hfpag_sco_start(struct hfpag_sco *sco);
+void hfpag_sco_stop(struct hfpag_sco *sco);
+void hfpag_sco_reset(struct hfpag_sco *sco);
+
+size_t hfpag_sco_write(struct hfpag_sco *sco, const void *data, size_t frames);
+size_t hfpag_sco_read(struct hfpag_sco *sco, void *data, size_t frames);
+size_t hfpag_sco_queued(struct hfpag_sco *sco);
+bool hfpag_sco_overrun(struct hfpag_sco *sco);
+
+#endif
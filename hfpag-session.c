@@ -7,271 +7,616 @@
 #define _GNU_SOURCE
 #include <alsa/asoundlib.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-
+#include <sys/eventfd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hfpag-broker.h"
+#include "hfpag-dbus.h"
+#include "hfpag-lock.h"
+#include "hfpag-rfcomm.h"
 #include "hfpag-session.h"
-#include "bluez-alsa/dbus-client-rfcomm.h"
+#include "bluez-alsa/defs.h"
 
-#define BLUEALSA_HFPAG_MUTEX_OFFSET 0
-#define BLUEALSA_HFPAG_FLAG_OFFSET 1
+/* maximum number of RFCOMM sockets watched by the monitor thread */
+#define BLUEALSA_HFPAG_MONITOR_DEVICES 16
 
-static const char *hfpag_transfer_call[] = {
-	"\r\n+CIEV:1,1\r\n",
-	"\r\n+CIEV:5,5\r\n",
-	"\r\n+CIEV:2,1\r\n",
-	NULL,
-};
+/* Maximum time in milliseconds to wait for the session lock of a device
+ * when no D-Bus deadline has been set. */
+#define BLUEALSA_HFPAG_LOCK_TIMEOUT 5000
+
+/* Minimum time in milliseconds to keep the call of a suspended session. */
+#define BLUEALSA_HFPAG_SUSPEND_LINGER 500
 
-static const char *hfpag_terminate_call[] = {
-	"\r\n+CIEV:2,0\r\n",
-	"\r\n+CIEV:5,0\r\n",
-	"\r\n+CIEV:1,0\r\n",
-	NULL,
+/**
+ * The call state of a device, shared by all sessions for that device in this
+ * process. Only the first session to begin and the last one to end take part
+ * in the coordination with other processes. */
+struct hfpag_device {
+	bdaddr_t addr;
+	/* number of sessions (and lingering calls) referring to the device */
+	unsigned int refs;
+	/* number of active sessions */
+	unsigned int active;
+	/* protects the active count and the call state */
+	pthread_mutex_t mutex;
+	/* the cross-process lock is held, i.e. the call is active */
+	atomic_bool locked;
+	/* BlueALSA service the device belongs to */
+	char service[32];
+	/* the lock used when no session broker is running */
+	struct hfpag_lock lock;
+	/* connection to the session broker, -1 if not used */
+	int broker_fd;
+	/* RFCOMM socket, kept open while the call is active, and read by
+	 * the monitor thread */
+	struct hfpag_rfcomm rfcomm;
+	/* D-Bus context used to end the call */
+	struct ba_dbus_ctx *dbus_ctx;
+	/* the call is kept active until the deadline */
+	bool lingering;
+	struct timespec deadline;
+	struct hfpag_device *next;
 };
 
-static void send_rfcomm_sequence(struct ba_dbus_ctx *dbus_ctx, const char *rfcomm_path, const char **commands) {
-	int rfcomm_fd;
-	DBusError err = DBUS_ERROR_INIT;
-	if (!ba_dbus_rfcomm_open(dbus_ctx, rfcomm_path, &rfcomm_fd, &err)) {
-		SNDERR("Couldn't open RFCOMM: %s", err.message);
-		dbus_error_free(&err);
-		return;
+/* protects the device list, the reference counts and the linger state */
+static pthread_mutex_t hfpag_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hfpag_device *hfpag_devices = NULL;
+
+static pthread_t hfpag_monitor_tid;
+static bool hfpag_monitor_running = false;
+static bool hfpag_monitor_quit = false;
+/* wakes the monitor thread up when the devices to watch have changed */
+static int hfpag_monitor_event_fd = -1;
+
+static int hfpag_monitor_start(void);
+
+/**
+ * Get the time to wait for the session lock. Another process should hold the
+ * lock only briefly, so a holder which hangs must not block us forever. */
+static int hfpag_lock_timeout(void) {
+	int timeout = ba_dbus_timeout();
+	if (timeout == DBUS_TIMEOUT_USE_DEFAULT)
+		timeout = BLUEALSA_HFPAG_LOCK_TIMEOUT;
+	return timeout;
+}
+
+/**
+ * Register our use of the device with the session broker. Returns the
+ * connected socket, -1 on error, or -2 if no broker is running. */
+static int hfpag_broker_begin(const char *service, const char *rfcomm_path) {
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int len = snprintf(&addr.sun_path[1], sizeof(addr.sun_path) - 1,
+			HFPAG_BROKER_SOCKET "%s", service);
+	socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+	int fd;
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+		int err = errno;
+		close(fd);
+		return err == ECONNREFUSED || err == ENOENT ? -2 : -1;
 	}
 
-	int n;
-	for (n = 0; commands[n] != NULL; n++) {
-		ssize_t written = write(rfcomm_fd, commands[n], strlen(commands[n]));
-		if (written < 0 || (size_t)written < strlen(commands[n])) {
-			SNDERR("Couldn't complete RFCOMM sequence: %s", strerror(errno));
-			break;
-		}
+	/* Anybody can bind the broker name, so make sure that the broker is run
+	 * by our user (or by root) before handing our call over to it. The
+	 * broker takes part in the locking, so it is safe to use the lock
+	 * instead. */
+	struct ucred cred = { .uid = (uid_t)-1 };
+	socklen_t cred_len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+			(cred.uid != getuid() && cred.uid != 0)) {
+		SNDERR("Ignoring session broker of another user: uid %d", (int)cred.uid);
+		close(fd);
+		return -2;
 	}
 
-	close(rfcomm_fd);
+	char msg[sizeof(HFPAG_BROKER_BEGIN) + 128];
+	len = snprintf(msg, sizeof(msg), HFPAG_BROKER_BEGIN "%s", rfcomm_path);
+	if (send(fd, msg, len, MSG_NOSIGNAL) != len)
+		goto fail;
+
+	/* Do not wait beyond the D-Bus deadline, if any. */
+	int timeout = ba_dbus_timeout();
+	if (timeout == DBUS_TIMEOUT_USE_DEFAULT || timeout > HFPAG_BROKER_TIMEOUT)
+		timeout = HFPAG_BROKER_TIMEOUT;
+
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	if (poll(&pfd, 1, timeout) <= 0) {
+		SNDERR("No reply from session broker");
+		goto fail;
+	}
+
+	ssize_t ret;
+	if ((ret = recv(fd, msg, sizeof(msg) - 1, 0)) <= 0)
+		goto fail;
+	msg[ret] = '\0';
+
+	if (strcmp(msg, HFPAG_BROKER_OK) != 0) {
+		SNDERR("Session broker failed to start call");
+		goto fail;
+	}
+
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
 }
 
-static const char *get_lock_dir(void) {
-
-	/* If /dev/shm is available and usable, we prefer it. */
-	char *lockdir = "/dev/shm";
-	if (faccessat(0, lockdir, R_OK|W_OK, AT_EACCESS) < 0) {
-		/* FIXME - if the capture and playback applications run in different
-		 * environments they may not see the same lock file. We really need a
-		 * more reliable way of agreeing a path for the lock file when /dev/shm
-		 * cannot be used. */
-		lockdir = getenv("XDG_RUNTIME_DIR");
-		if (lockdir == NULL) {
-			lockdir = getenv("TMPDIR");
-			if (lockdir == NULL)
-				lockdir = "/tmp";
+/**
+ * An HFP device has 2 PCMs (playback and capture), possibly opened by
+ * different processes, so we need to ensure that only the first one opened
+ * sends the RFCOMM call transfer sequence, and only the last one closed sends
+ * the RFCOMM call termination sequence. If a session broker is running it
+ * does this for us, otherwise we use the configured locking backend.
+ * Must be called with the device mutex locked. */
+static int hfpag_device_lock(struct hfpag_device *device, struct ba_dbus_ctx *dbus_ctx) {
+
+	int fd = hfpag_broker_begin(dbus_ctx->ba_service, device->rfcomm.path);
+	if (fd == -1)
+		return -1;
+
+	if (fd != -2)
+		device->broker_fd = fd;
+	else {
+		bool first;
+		if (hfpag_lock_join(&device->lock, &first, hfpag_lock_timeout()) == -1)
+			return -1;
+		if (first)
+			hfpag_rfcomm_transfer_call(&device->rfcomm, dbus_ctx);
+		hfpag_lock_release(&device->lock);
+	}
+
+	device->dbus_ctx = hfpag_dbus_ref(dbus_ctx);
+	device->locked = true;
+
+	/* The HF may send AT commands while the call is active, which need a
+	 * timely reply. If we cannot read them, do not keep the socket open. */
+	if (device->rfcomm.fd != -1) {
+		pthread_mutex_lock(&hfpag_devices_mutex);
+		if (hfpag_monitor_start() == 0)
+			eventfd_write(hfpag_monitor_event_fd, 1);
+		else
+			hfpag_rfcomm_close(&device->rfcomm);
+		pthread_mutex_unlock(&hfpag_devices_mutex);
+	}
+
+	return 0;
+}
+
+/**
+ * Give up our part in the call session, terminating the call if no other
+ * process is using the device. Must be called with the device mutex locked. */
+static int hfpag_device_unlock(struct hfpag_device *device) {
+
+	int ret = 0;
+	if (device->broker_fd != -1) {
+		/* The broker ends our part in the call when the connection closes. */
+		close(device->broker_fd);
+		device->broker_fd = -1;
+	}
+	else {
+		bool last;
+		if ((ret = hfpag_lock_leave(&device->lock, &last, hfpag_lock_timeout())) == 0) {
+			if (last)
+				hfpag_rfcomm_terminate_call(&device->rfcomm, device->dbus_ctx);
+			/* Otherwise some other stream will terminate the call, and it
+			 * may need to open the RFCOMM socket to do so. */
+			hfpag_rfcomm_close(&device->rfcomm);
+			hfpag_lock_release(&device->lock);
 		}
 	}
 
-	return lockdir;
+	/* Nobody reads the socket once the call has ended. */
+	hfpag_rfcomm_close(&device->rfcomm);
+
+	hfpag_dbus_put(device->dbus_ctx);
+	device->dbus_ctx = NULL;
+	device->locked = false;
+	return ret;
 }
 
-int hfpag_session_init(struct hfpag_session **phfpag, const char *device_path, const bdaddr_t *addr) {
+/**
+ * Get the device with the given address, which all sessions for the device
+ * in this process share. The sessions must agree on the service and the lock
+ * backend, otherwise they would not agree the call state with each other. */
+static int hfpag_device_get(struct hfpag_device **pdevice, const char *service,
+		const char *rfcomm_path, const bdaddr_t *addr, enum hfpag_session_lock lock) {
 
-	if (strlen(device_path) < 37) {
-		SNDERR("Invalid PCM device path");
-		return -EINVAL;
+	int ret = 0;
+	pthread_mutex_lock(&hfpag_devices_mutex);
+
+	struct hfpag_device *device;
+	for (device = hfpag_devices; device != NULL; device = device->next)
+		if (bacmp(&device->addr, addr) == 0) {
+			if (strcmp(device->service, service) != 0 || device->lock.type != lock) {
+				SNDERR("Device already in use with another service or lock type: %s",
+						rfcomm_path);
+				ret = -EINVAL;
+				goto final;
+			}
+			device->refs++;
+			goto final;
+		}
+
+	if ((device = calloc(1, sizeof(*device))) == NULL) {
+		ret = -ENOMEM;
+		goto final;
 	}
 
-	struct hfpag_session *hfpag = malloc(sizeof(struct hfpag_session));
-	if (hfpag == NULL)
-		return -ENOMEM;
+	strncpy(device->service, service, sizeof(device->service) - 1);
+	hfpag_rfcomm_init(&device->rfcomm, rfcomm_path);
+	hfpag_lock_init(&device->lock, lock, addr);
+
+	bacpy(&device->addr, addr);
+	device->refs = 1;
+	device->active = 0;
+	pthread_mutex_init(&device->mutex, NULL);
+	device->broker_fd = -1;
 
-	const char *dev_path = device_path + 11;
-	snprintf(hfpag->rfcomm_path, sizeof(hfpag->rfcomm_path), "/org/bluealsa/%s/rfcomm", dev_path);
+	device->next = hfpag_devices;
+	hfpag_devices = device;
 
-	snprintf(hfpag->lock_file, PATH_MAX,
-			"%s/bahfpag%.2X%.2X%.2X%.2X%.2X%.2X.lock",
-			get_lock_dir(),
-			addr->b[5], addr->b[4], addr->b[3],
-			addr->b[2], addr->b[1], addr->b[0]);
+final:
+	pthread_mutex_unlock(&hfpag_devices_mutex);
+	*pdevice = device;
+	return ret;
+}
 
-	hfpag->lock_fd = -1;
+static void hfpag_device_put(struct hfpag_device *device) {
 
-	*phfpag = hfpag;
+	pthread_mutex_lock(&hfpag_devices_mutex);
+
+	if (--device->refs > 0) {
+		pthread_mutex_unlock(&hfpag_devices_mutex);
+		return;
+	}
+
+	struct hfpag_device **pdevice;
+	for (pdevice = &hfpag_devices; *pdevice != NULL; pdevice = &(*pdevice)->next)
+		if (*pdevice == device) {
+			*pdevice = device->next;
+			break;
+		}
+
+	pthread_mutex_unlock(&hfpag_devices_mutex);
+
+	if (device->locked)
+		hfpag_device_unlock(device);
+	hfpag_rfcomm_close(&device->rfcomm);
+	pthread_mutex_destroy(&device->mutex);
+	free(device);
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
 	return 0;
 }
 
 /**
- * An HFP device has 2 PCMs (playback and capture), so we need to ensure that
- * only the first one opened sends the RFCOMM call transfer sequence, and only
- * the last one closed sends the RFCOMM call termination sequence. We use Linux-
- * specific Open File Descriptor Locking to achieve this, since neither POSIX
- * nor BSD file locks have the necessary semantics.
- */
-int hfpag_session_begin(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx) {
-	/* lock to ensure exclusive access to the call session state. */
-	struct flock mutex_lock = {
-		.l_type = F_WRLCK,
-		.l_whence = SEEK_SET,
-		.l_start = BLUEALSA_HFPAG_MUTEX_OFFSET,
-		.l_len = 1,
-	};
-
-	/* shared lock held continuously while call session is active. */
-	struct flock flag_lock = {
-		.l_type = F_RDLCK,
-		.l_whence = SEEK_SET,
-		.l_start = BLUEALSA_HFPAG_FLAG_OFFSET,
-		.l_len = 1,
-	};
+ * Get the time in milliseconds until the given time, rounded up. */
+static int timespec_remaining_ms(const struct timespec *ts) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_cmp(&now, ts) >= 0)
+		return 0;
+	long ms = (ts->tv_sec - now.tv_sec) * 1000 + (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : ms;
+}
 
-	int fd;
-	int err;
-	int retries = 5;
-	while (retries > 0) {
-		fd = open(hfpag->lock_file, O_CREAT|O_CLOEXEC|O_RDWR, S_IRUSR|S_IWUSR);
-		if (fd == -1) {
-			SNDERR("Unable to open lock file");
-			return -1;
-		}
+/**
+ * End the calls of lingering devices when their linger period expires, and
+ * answer the AT commands which the HF sends while we hold a call. */
+static void *hfpag_monitor_thread(void *arg) {
+	(void)arg;
 
-		/* Wait for mutex lock before managing call state. */
-		err = fcntl(fd, F_OFD_SETLKW, &mutex_lock);
-		if (err == -1) {
-			SNDERR("Unable to set lock file");
-			close(fd);
-			return -1;
-		}
+	pthread_mutex_lock(&hfpag_devices_mutex);
 
-		/* There is a chance that the lock file was unlinked while this process
-		 * was waiting for the mutex. In that case the descriptor fd is no
-		 * longer referring to the correct file. So we check that we are indeed
-		 * looking at the correct file path by comparing the inode of the fd
-		 * with the current inode of the lock file path. */
-		struct stat fd_stat;
-		if (fstat(fd, &fd_stat) < 0) {
-			SNDERR("Unable to check lock file");
-			close(fd);
-			return -1;
+	while (!hfpag_monitor_quit) {
+
+		struct hfpag_device *device;
+		struct hfpag_device *next = NULL;
+		for (device = hfpag_devices; device != NULL; device = device->next)
+			if (device->lingering && (next == NULL ||
+						timespec_cmp(&device->deadline, &next->deadline) < 0))
+				next = device;
+
+		if (next != NULL && timespec_remaining_ms(&next->deadline) == 0) {
+
+			/* The linger reference is passed on to us. */
+			next->lingering = false;
+			pthread_mutex_unlock(&hfpag_devices_mutex);
+
+			pthread_mutex_lock(&next->mutex);
+			if (next->active == 0 && next->locked)
+				hfpag_device_unlock(next);
+			pthread_mutex_unlock(&next->mutex);
+			hfpag_device_put(next);
+
+			pthread_mutex_lock(&hfpag_devices_mutex);
+			continue;
 		}
-		struct stat path_stat;
-		err = stat(hfpag->lock_file, &path_stat);
-		if (err < 0 && errno != ENOENT) {
-			SNDERR("Unable to check lock file");
-			close(fd);
-			return -1;
+
+		const int timeout = next != NULL ? timespec_remaining_ms(&next->deadline) : -1;
+
+		/* Hold a reference to every device we watch, so that it outlives
+		 * the poll even if all its sessions are freed meanwhile. */
+		struct hfpag_device *devices[BLUEALSA_HFPAG_MONITOR_DEVICES];
+		size_t count = 0;
+		for (device = hfpag_devices; device != NULL; device = device->next)
+			if (device->locked && count < ARRAYSIZE(devices)) {
+				device->refs++;
+				devices[count++] = device;
+			}
+
+		pthread_mutex_unlock(&hfpag_devices_mutex);
+
+		struct pollfd pfds[1 + ARRAYSIZE(devices)] = {
+			{ hfpag_monitor_event_fd, POLLIN, 0 } };
+		for (size_t i = 0; i < count; i++) {
+			pthread_mutex_lock(&devices[i]->mutex);
+			pfds[1 + i].fd = devices[i]->rfcomm.fd;
+			pfds[1 + i].events = POLLIN;
+			pthread_mutex_unlock(&devices[i]->mutex);
 		}
-		if (errno == ENOENT || fd_stat.st_ino != path_stat.st_ino) {
-			/* The lock file we opened is no longer valid - try again. */
-			close(fd);
-			fd = -1;
-			--retries;
-			continue;
+
+		if (poll(pfds, 1 + count, timeout) > 0) {
+
+			if (pfds[0].revents & POLLIN) {
+				eventfd_t value;
+				eventfd_read(hfpag_monitor_event_fd, &value);
+			}
+
+			for (size_t i = 0; i < count; i++) {
+				if (pfds[1 + i].revents == 0)
+					continue;
+				pthread_mutex_lock(&devices[i]->mutex);
+				/* The socket may have been replaced while we were polling. */
+				if (devices[i]->rfcomm.fd == pfds[1 + i].fd &&
+						hfpag_rfcomm_dispatch(&devices[i]->rfcomm) == -1)
+					hfpag_rfcomm_close(&devices[i]->rfcomm);
+				pthread_mutex_unlock(&devices[i]->mutex);
+			}
+
 		}
 
-		break;
+		for (size_t i = 0; i < count; i++)
+			hfpag_device_put(devices[i]);
+
+		pthread_mutex_lock(&hfpag_devices_mutex);
+
 	}
-	if (fd == -1) {
-		SNDERR("Unable to open lock file - maximum retries exceeded");
+
+	pthread_mutex_unlock(&hfpag_devices_mutex);
+	return NULL;
+}
+
+/**
+ * Must be called with the devices mutex locked. */
+static int hfpag_monitor_start(void) {
+
+	if (hfpag_monitor_running)
+		return 0;
+	if (hfpag_monitor_quit)
 		return -1;
+
+	if (hfpag_monitor_event_fd == -1 &&
+			(hfpag_monitor_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return -1;
+
+	/* Signals must be handled by the application threads. */
+	sigset_t sigset, oldset;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	int err = pthread_create(&hfpag_monitor_tid, NULL, hfpag_monitor_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (err != 0)
+		return -1;
+
+	hfpag_monitor_running = true;
+	return 0;
+}
+
+/**
+ * Keep the call of an idle device active for the given time, in case the
+ * application re-opens the device. Must be called with the device mutex
+ * locked. */
+static int hfpag_linger_start(struct hfpag_device *device, unsigned int linger) {
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += linger / 1000;
+	deadline.tv_nsec += (linger % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
 
-	/* set flag lock to indicate we are using this HFP device. */
-	err = fcntl(fd, F_OFD_SETLKW, &flag_lock);
-	if (err == -1) {
-		SNDERR("Unable to set lock file");
-		close(fd);
+	pthread_mutex_lock(&hfpag_devices_mutex);
+
+	if (hfpag_monitor_start() == -1) {
+		pthread_mutex_unlock(&hfpag_devices_mutex);
 		return -1;
 	}
 
-	/* test if we can switch flag to an exclusive lock - if so no other process
-	 * (or thread) is using this HFP device. */
-	flag_lock.l_type = F_WRLCK;
-	err = fcntl(fd, F_OFD_SETLK, &flag_lock);
-	if (err == -1) {
-		if (errno != EAGAIN) {
-			SNDERR("Unable to test lock file");
-			close(fd);
-			return -1;
+	/* The lingering call holds a reference, so that the device outlives
+	 * the sessions using it. */
+	if (!device->lingering) {
+		device->lingering = true;
+		device->refs++;
+	}
+
+	device->deadline = deadline;
+
+	eventfd_write(hfpag_monitor_event_fd, 1);
+	pthread_mutex_unlock(&hfpag_devices_mutex);
+	return 0;
+}
+
+/**
+ * Release the locks of lingering calls when the process exits. Other threads
+ * may still be running and the D-Bus connection may already be gone, so the
+ * calls are not ended here. Closing the descriptors lets the kernel drop our
+ * locks (or our broker connection), so that the remaining processes see the
+ * device as free. The library is never unloaded (see meson.build), so the
+ * monitor thread is not joined. */
+__attribute__((destructor))
+static void hfpag_session_cleanup(void) {
+
+	/* Never wait for a thread which might be stuck in a D-Bus call. */
+	if (pthread_mutex_trylock(&hfpag_devices_mutex) != 0)
+		return;
+
+	hfpag_monitor_quit = true;
+
+	struct hfpag_device *device;
+	for (device = hfpag_devices; device != NULL; device = device->next) {
+		if (!device->lingering || pthread_mutex_trylock(&device->mutex) != 0)
+			continue;
+		if (device->active == 0 && device->locked) {
+			close(device->broker_fd != -1 ? device->broker_fd : device->lock.fd);
+			hfpag_rfcomm_close(&device->rfcomm);
+			device->broker_fd = device->lock.fd = -1;
+			device->locked = false;
 		}
+		pthread_mutex_unlock(&device->mutex);
 	}
-	else {
-		/* We are (currently) the only process using this HFP device */
-		send_rfcomm_sequence(dbus_ctx, hfpag->rfcomm_path, hfpag_transfer_call);
 
-		/* Revert the flag to a shared lock */
-		flag_lock.l_type = F_RDLCK;
-		err = fcntl(fd, F_OFD_SETLK, &flag_lock);
+	pthread_mutex_unlock(&hfpag_devices_mutex);
+
+}
+
+int hfpag_session_init(struct hfpag_session **phfpag, const char *service,
+		const char *rfcomm_path, const bdaddr_t *addr,
+		enum hfpag_session_lock lock, unsigned int linger) {
+
+	if (strlen(rfcomm_path) >= sizeof(((struct hfpag_rfcomm *)0)->path)) {
+		SNDERR("Invalid RFCOMM path");
+		return -EINVAL;
 	}
 
-	/* Release the mutex lock. */
-	mutex_lock.l_type = F_UNLCK;
-	err = fcntl(fd, F_OFD_SETLK, &mutex_lock);
-	if (err == -1) {
-		SNDERR("Unable to release lock file");
-		close(fd);
-		return -1;
+	struct hfpag_session *hfpag = malloc(sizeof(struct hfpag_session));
+	if (hfpag == NULL)
+		return -ENOMEM;
+
+	int ret;
+	if ((ret = hfpag_device_get(&hfpag->device, service, rfcomm_path, addr, lock)) < 0) {
+		free(hfpag);
+		return ret;
 	}
 
-	hfpag->lock_fd = fd;
+	hfpag->active = false;
+	hfpag->linger = linger;
+
+	*phfpag = hfpag;
 	return 0;
 }
 
-int hfpag_session_end(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx) {
-	struct flock mutex_lock = {
-		.l_type = F_WRLCK,
-		.l_whence = SEEK_SET,
-		.l_start = BLUEALSA_HFPAG_MUTEX_OFFSET,
-		.l_len = 1,
-	};
-
-	struct flock flag_lock = {
-		.l_type = F_WRLCK,
-		.l_whence = SEEK_SET,
-		.l_start = BLUEALSA_HFPAG_FLAG_OFFSET,
-		.l_len = 1,
-	};
-
-	if (hfpag->lock_fd == -1)
+/**
+ * Only the first session of the process to begin needs to take part in the
+ * cross-process call state, all others merely increment the active count.
+ * Beginning a session which is already active has no effect. */
+int hfpag_session_begin(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx) {
+
+	struct hfpag_device *device = hfpag->device;
+	int ret = 0;
+
+	if (hfpag->active)
 		return 0;
 
+	/* Every session waits for the first one to take the lock, so that it
+	 * never reports success for a call which fails to start. */
+	pthread_mutex_lock(&device->mutex);
+	/* The call may still be active if the device was closed only recently. */
+	if (!device->locked)
+		ret = hfpag_device_lock(device, dbus_ctx);
+	if (ret == 0) {
+		device->active++;
+		hfpag->active = true;
+	}
+	pthread_mutex_unlock(&device->mutex);
+
+	return ret;
+}
+
+static int hfpag_session_release(struct hfpag_session *hfpag, unsigned int linger) {
+
+	struct hfpag_device *device = hfpag->device;
 	int ret = 0;
 
-	/* Wait for mutex lock before managing call state. */
-	int err = fcntl(hfpag->lock_fd, F_OFD_SETLKW, &mutex_lock);
-	if (err == -1) {
-		SNDERR("Unable to set lock file");
-		ret = -1;
-		goto finish;
+	if (!hfpag->active)
+		return 0;
+	hfpag->active = false;
+
+	pthread_mutex_lock(&device->mutex);
+	if (--device->active == 0 && device->locked) {
+		/* Keep the call active for the linger period, in case the
+		 * application re-opens the device. */
+		if (linger == 0 || hfpag_linger_start(device, linger) == -1)
+			ret = hfpag_device_unlock(device);
 	}
+	pthread_mutex_unlock(&device->mutex);
+
+	return ret;
+}
 
-	/* test if we can switch the flag to an exclusive lock - if so no other
-	 * process (or thread) is using this HFP device. */
-	err = fcntl(hfpag->lock_fd, F_OFD_SETLK, &flag_lock);
-	if (err == -1) {
-		if (errno != EAGAIN) {
-			SNDERR("Unable to test lock file");
-			ret = -1;
-			goto finish;
+int hfpag_session_end(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx) {
+	(void)dbus_ctx;
+	return hfpag_session_release(hfpag, hfpag->linger);
+}
+
+/**
+ * End the session, but keep the call for at least a short while, so that a
+ * session which begins again straight away continues the call without any
+ * signalling. This is meant for the hw_free which alsa-lib runs before it
+ * sets the hardware parameters again. */
+int hfpag_session_suspend(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx) {
+	(void)dbus_ctx;
+	return hfpag_session_release(hfpag, MAX(hfpag->linger, BLUEALSA_HFPAG_SUSPEND_LINGER));
+}
+
+/**
+ * Check whether this process holds an active call with the given device.
+ * Returns 1 if so, 0 if not, or -1 if the device is not used by us. */
+int hfpag_session_call_active(const bdaddr_t *addr) {
+
+	int ret = -1;
+
+	pthread_mutex_lock(&hfpag_devices_mutex);
+	struct hfpag_device *device;
+	for (device = hfpag_devices; device != NULL; device = device->next)
+		if (bacmp(&device->addr, addr) == 0) {
+			ret = device->locked ? 1 : 0;
+			break;
 		}
-	}
-	else {
-		/* We are (currently) the only process using this HFP device */
-		send_rfcomm_sequence(dbus_ctx, hfpag->rfcomm_path, hfpag_terminate_call);
-		unlink(hfpag->lock_file);
-	}
+	pthread_mutex_unlock(&hfpag_devices_mutex);
 
-finish:
-	/* closing the lock file automatically releases all locks */
-	close(hfpag->lock_fd);
-	hfpag->lock_fd = -1;
 	return ret;
 }
 
 void hfpag_session_free(struct hfpag_session *hfpag) {
-	if (hfpag->lock_fd >= 0) {
-		close(hfpag->lock_fd);
-		hfpag->lock_fd = -1;
-	}
+	hfpag_session_end(hfpag, NULL);
+	hfpag_device_put(hfpag->device);
 	free(hfpag);
 }
-
@@ -10,19 +10,39 @@
 
 #include <bluetooth/bluetooth.h>
 #include <dbus/dbus.h>
-#include <limits.h>
+#include <stdbool.h>
 
 #include "bluez-alsa/dbus-client.h"
 
+/**
+ * The mechanism used to agree the call state with other streams. */
+enum hfpag_session_lock {
+	/* OFD locks on a lock file */
+	HFPAG_SESSION_LOCK_FILE,
+	/* sockets in the abstract namespace */
+	HFPAG_SESSION_LOCK_SOCKET,
+	/* connection to the session broker */
+	HFPAG_SESSION_LOCK_BROKER,
+};
+
+struct hfpag_device;
+
 struct hfpag_session {
-	char rfcomm_path[128];
-	char lock_file[PATH_MAX + 1];
-	int lock_fd;
+	/* call state shared with the other sessions for the device */
+	struct hfpag_device *device;
+	bool active;
+	/* time in milliseconds to keep the call active after the session ends */
+	unsigned int linger;
 };
 
-int hfpag_session_init(struct hfpag_session **phfpag, const char *device_path, const bdaddr_t *addr);
+int hfpag_session_init(struct hfpag_session **phfpag, const char *service,
+		const char *rfcomm_path, const bdaddr_t *addr,
+		enum hfpag_session_lock lock, unsigned int linger);
 int hfpag_session_begin(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx);
 int hfpag_session_end(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_session_suspend(struct hfpag_session *hfpag, struct ba_dbus_ctx *dbus_ctx);
 void hfpag_session_free(struct hfpag_session *hfpag);
 
+int hfpag_session_call_active(const bdaddr_t *addr);
+
 #endif
@@ -0,0 +1,212 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-worker.c
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "hfpag-dbus.h"
+#include "hfpag-worker.h"
+
+enum hfpag_job_type {
+	HFPAG_JOB_BEGIN,
+	HFPAG_JOB_END,
+	/* end the session, keeping the call for a short while */
+	HFPAG_JOB_SUSPEND,
+	/* end the session and release it, together with the D-Bus context */
+	HFPAG_JOB_FREE,
+};
+
+struct hfpag_job {
+	enum hfpag_job_type type;
+	struct hfpag_session *session;
+	struct ba_dbus_ctx *dbus_ctx;
+	struct hfpag_job *next;
+};
+
+static pthread_mutex_t hfpag_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hfpag_worker_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t hfpag_worker_tid;
+static bool hfpag_worker_running = false;
+static bool hfpag_worker_quit = false;
+/* incremented every time a job has been completed */
+static int hfpag_worker_event_fd = -1;
+/* pending jobs, in submission order */
+static struct hfpag_job *hfpag_jobs = NULL;
+static struct hfpag_job **hfpag_jobs_tail = &hfpag_jobs;
+
+static void hfpag_job_run(struct hfpag_job *job) {
+
+	switch (job->type) {
+	case HFPAG_JOB_BEGIN:
+		if (hfpag_session_begin(job->session, job->dbus_ctx) != 0)
+			SNDERR("Couldn't start HFP call session");
+		break;
+	case HFPAG_JOB_END:
+		hfpag_session_end(job->session, job->dbus_ctx);
+		break;
+	case HFPAG_JOB_SUSPEND:
+		hfpag_session_suspend(job->session, job->dbus_ctx);
+		break;
+	case HFPAG_JOB_FREE:
+		hfpag_session_end(job->session, job->dbus_ctx);
+		hfpag_session_free(job->session);
+		/* release the reference handed over by the submitter */
+		hfpag_dbus_put(job->dbus_ctx);
+		break;
+	}
+
+	hfpag_dbus_put(job->dbus_ctx);
+	free(job);
+
+	eventfd_write(hfpag_worker_event_fd, 1);
+
+}
+
+/**
+ * Take the next job from the queue. Returns NULL when the worker should exit.
+ * Must be called with the worker mutex locked. */
+static struct hfpag_job *hfpag_job_next(void) {
+
+	while (hfpag_jobs == NULL && !hfpag_worker_quit)
+		pthread_cond_wait(&hfpag_worker_cond, &hfpag_worker_mutex);
+
+	struct hfpag_job *job;
+	if ((job = hfpag_jobs) != NULL)
+		if ((hfpag_jobs = job->next) == NULL)
+			hfpag_jobs_tail = &hfpag_jobs;
+
+	return job;
+}
+
+static void *hfpag_worker_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&hfpag_worker_mutex);
+
+	struct hfpag_job *job;
+	while ((job = hfpag_job_next()) != NULL) {
+		pthread_mutex_unlock(&hfpag_worker_mutex);
+		hfpag_job_run(job);
+		pthread_mutex_lock(&hfpag_worker_mutex);
+	}
+
+	pthread_mutex_unlock(&hfpag_worker_mutex);
+	return NULL;
+}
+
+/**
+ * Must be called with the worker mutex locked. */
+static int hfpag_worker_start(void) {
+
+	if (hfpag_worker_running)
+		return 0;
+	if (hfpag_worker_quit)
+		return -1;
+
+	if (hfpag_worker_event_fd == -1 &&
+			(hfpag_worker_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+		return -1;
+
+	/* Signals must be handled by the application threads. */
+	sigset_t sigset, oldset;
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+	int err = pthread_create(&hfpag_worker_tid, NULL, hfpag_worker_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (err != 0)
+		return -1;
+
+	hfpag_worker_running = true;
+	return 0;
+}
+
+static int hfpag_worker_submit(enum hfpag_job_type type,
+		struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx) {
+
+	struct hfpag_job *job;
+	if ((job = malloc(sizeof(*job))) == NULL)
+		return -1;
+
+	job->type = type;
+	job->session = session;
+	job->next = NULL;
+
+	pthread_mutex_lock(&hfpag_worker_mutex);
+
+	if (hfpag_worker_start() == -1) {
+		pthread_mutex_unlock(&hfpag_worker_mutex);
+		free(job);
+		return -1;
+	}
+
+	job->dbus_ctx = hfpag_dbus_ref(dbus_ctx);
+	*hfpag_jobs_tail = job;
+	hfpag_jobs_tail = &job->next;
+
+	pthread_cond_signal(&hfpag_worker_cond);
+	pthread_mutex_unlock(&hfpag_worker_mutex);
+	return 0;
+}
+
+/**
+ * Begin the session in the background. The jobs of all sessions are run in
+ * submission order, so a later end or free always sees the begin done. */
+int hfpag_worker_begin(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx) {
+	return hfpag_worker_submit(HFPAG_JOB_BEGIN, session, dbus_ctx);
+}
+
+int hfpag_worker_end(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx) {
+	return hfpag_worker_submit(HFPAG_JOB_END, session, dbus_ctx);
+}
+
+int hfpag_worker_suspend(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx) {
+	return hfpag_worker_submit(HFPAG_JOB_SUSPEND, session, dbus_ctx);
+}
+
+/**
+ * End and free the session in the background. The caller's reference to the
+ * D-Bus context is taken over by the worker. If the job cannot be queued, the
+ * work is done synchronously. */
+int hfpag_worker_free(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx) {
+
+	if (hfpag_worker_submit(HFPAG_JOB_FREE, session, dbus_ctx) == 0)
+		return 0;
+
+	hfpag_session_end(session, dbus_ctx);
+	hfpag_session_free(session);
+	hfpag_dbus_put(dbus_ctx);
+	return 0;
+}
+
+/**
+ * Get the file descriptor of an eventfd counter which is incremented each
+ * time a background session transition has completed. */
+int hfpag_worker_status_fd(void) {
+	pthread_mutex_lock(&hfpag_worker_mutex);
+	int fd = hfpag_worker_start() == 0 ? hfpag_worker_event_fd : -1;
+	pthread_mutex_unlock(&hfpag_worker_mutex);
+	return fd;
+}
+
+/**
+ * Stop taking new jobs when the process exits. Pending jobs are not waited
+ * for: they may block in D-Bus calls, and the kernel releases the locks held
+ * by their sessions anyway. The library is never unloaded (see meson.build),
+ * so the worker is not joined. */
+__attribute__((destructor))
+static void hfpag_worker_cleanup(void) {
+	if (pthread_mutex_trylock(&hfpag_worker_mutex) != 0)
+		return;
+	hfpag_worker_quit = true;
+	pthread_mutex_unlock(&hfpag_worker_mutex);
+}
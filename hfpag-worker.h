@@ -0,0 +1,20 @@
+/*
+ * bluealsa-hfpag-plugin - hfpag-worker.h
+ * SPDX-FileCopyrightText: 2016-2025 @borine <https://github.com/borine/>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef HFPAG_WORKER_H_
+#define HFPAG_WORKER_H_
+
+#include "hfpag-session.h"
+#include "bluez-alsa/dbus-client.h"
+
+int hfpag_worker_begin(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_worker_end(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_worker_suspend(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_worker_free(struct hfpag_session *session, struct ba_dbus_ctx *dbus_ctx);
+int hfpag_worker_status_fd(void);
+
+#endif